@@ -0,0 +1,146 @@
+/*******************************************************************************
+* Copyright (c) 2015 Intel Corporation
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*******************************************************************************/
+#ifndef _BOOT_INFO_H
+#define _BOOT_INFO_H
+
+/*
+ * Boot info is a fixed-size page reserved next to startap. The loaders
+ * record TSC at every boot phase boundary, xmon gets its address as the
+ * last entry argument and Linux gets it in "xmon_boot_info=" on cmdline.
+ */
+
+#define BOOT_INFO_SIGNATURE     0x49544f42      /* "BOTI" */
+#define BOOT_INFO_VERSION       6
+
+#define BOOT_TIMELINE_MAX_ENTRIES 64
+#define BOOT_INFO_MAX_APS         80
+#define BOOT_INFO_MAX_PACKAGES    8
+
+typedef enum {
+	BOOT_EVENT_STARTER_ENTRY = 1,
+	BOOT_EVENT_XMON_LOADER_ENTRY,
+	BOOT_EVENT_E820_READY,
+	BOOT_EVENT_XMON_LOADED,
+	BOOT_EVENT_STARTAP_LOADED,
+	BOOT_EVENT_PAGE_TABLES_READY,
+	BOOT_EVENT_STARTAP_ENTRY,
+	BOOT_EVENT_APS_STARTED,
+	BOOT_EVENT_XMON_LAUNCH,
+	BOOT_EVENT_LINUX_LOADER_ENTRY,
+	BOOT_EVENT_LINUX_LAUNCH,
+	BOOT_EVENT_APS_KICKED,
+} boot_event_t;
+
+/* how startap calibrated tsc_ticks_per_msec */
+typedef enum {
+	BOOT_TSC_SOURCE_NONE = 0,
+	BOOT_TSC_SOURCE_CPUID_CRYSTAL,  /* CPUID 0x15 crystal clock and ratio */
+	BOOT_TSC_SOURCE_CPUID_NOMINAL,  /* CPUID 0x16 base frequency */
+	BOOT_TSC_SOURCE_PIT,            /* measured against PIT channel 2 */
+	BOOT_TSC_SOURCE_IO_DELAY,       /* measured against port 0x80 writes */
+} boot_tsc_source_t;
+
+typedef struct {
+	uint32_t event;                 /* boot_event_t */
+	uint32_t pad;
+	uint64_t tsc;
+} boot_timeline_entry_t;
+
+/* AP bring-up stamps, in TSC ticks since ap_tsc_base. 0 - not recorded,
+ * 0xFFFFFFFF - too late to fit */
+typedef struct {
+	uint32_t apic_id;
+	uint32_t package_id;
+	uint32_t sipi;                  /* the last SIPI sent before arrival */
+	uint32_t arrival;               /* AP checked in, stage 1 */
+	uint32_t stage2;                /* AP left the wait loop, stage 2 */
+	uint32_t launch;                /* AP jumps to 64-bit xmon entry */
+} boot_ap_timing_t;
+
+/* per package summary of AP latencies since SIPI, in TSC ticks */
+typedef struct {
+	uint32_t package_id;
+	uint32_t ap_count;
+	uint32_t arrival_min;
+	uint32_t arrival_median;
+	uint32_t arrival_max;
+	uint32_t launch_min;
+	uint32_t launch_median;
+	uint32_t launch_max;
+} boot_package_timing_t;
+
+typedef struct {
+	uint32_t signature;
+	uint32_t size_of_this_struct;
+	uint32_t version_of_this_struct;
+	uint32_t timeline_count;        /* number of valid timeline entries */
+	boot_timeline_entry_t timeline[BOOT_TIMELINE_MAX_ENTRIES];
+
+	/* version 2 */
+	uint32_t tsc_ticks_per_msec;    /* 0 if not calibrated */
+	uint32_t tsc_source;            /* boot_tsc_source_t */
+
+	/* version 3, filled by startap once APs are launched. The whole
+	 * structure must fit in BOOT_INFO_SIZE */
+	uint64_t ap_tsc_base;           /* TSC of the first SIPI */
+	uint32_t ap_timing_count;
+	uint32_t package_timing_count;
+	boot_ap_timing_t ap_timing[BOOT_INFO_MAX_APS];
+	boot_package_timing_t package_timing[BOOT_INFO_MAX_PACKAGES];
+
+	/* version 4. With asynchronous AP launch xmon starts on BSP before APs
+	 * left startap, it should wait for aps_launched to reach aps_released
+	 * where it needs all of them. It must wait for that before it launches
+	 * the primary guest: until then APs may still be on their way to xmon
+	 * entry, whose arguments (mon_startup_struct_t) are in loader memory
+	 * given back to Linux. The primary guest loader waits for it as well */
+	uint32_t aps_released;          /* APs released to xmon entry */
+	volatile uint32_t aps_launched; /* APs which left for xmon entry, must
+					 * reach aps_released before the
+					 * primary guest is launched */
+
+	/* version 5. Lazy AP launch: aps_deferred more APs wait in startap,
+	 * their ordered IDs follow the released ones. xmon lets the first
+	 * ap_release of them go to xmon entry by raising ap_release, they
+	 * are counted in aps_launched as well.
+	 * Parked APs, with interrupts disabled, use only memory hidden from
+	 * Linux: startap code and data (init64 copy and AP stack tops
+	 * included), this page, and the AP runtime area at the top of xmon
+	 * memory, above mon_memory_layout[mon_image].total_size, which holds
+	 * their stacks and the GDT and page tables of init64. So xmon may
+	 * release them after Linux started. The xmon entry arguments they get
+	 * (mon_startup_struct_t and what it points to) are in loader memory,
+	 * which is stale by then */
+	uint32_t aps_deferred;          /* APs parked by the launch policy */
+	volatile uint32_t ap_release;   /* xmon: deferred APs to release */
+
+	/* version 6. TSC offsets of APs against BSP, measured by ping-pong
+	 * before the launch, ap_tsc_offset[] has the same index as ap_timing[].
+	 * TSC is reliable if it is invariant, every AP given to xmon, deferred
+	 * ones included, was measured, and none read it out of the BSP round
+	 * trip window. Not measured with long mode or asynchronous AP launch,
+	 * and for deferred APs */
+	uint32_t tsc_sync_count;        /* APs measured, 0 - not measured */
+	uint32_t tsc_reliable;          /* 1 - rdtsc is usable across CPUs */
+	uint32_t tsc_sync_error;        /* max offset error, half round trip */
+	int32_t ap_tsc_offset[BOOT_INFO_MAX_APS]; /* AP TSC - BSP TSC */
+} boot_info_t;
+
+void boot_info_init(boot_info_t *boot_info);
+boot_info_t *boot_info_validate(uint32_t addr);
+void boot_info_record(boot_info_t *boot_info, boot_event_t event);
+
+#endif
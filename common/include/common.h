@@ -20,4 +20,14 @@ void *mon_memset(void *dest, char val, unsigned int count);
 void *mon_memcpy(void *dest, const void *src, unsigned int count);
 int mon_strlen(const char *string);
 
+/*
+ * Optional handler for large mon_memset()/mon_memcpy() calls, src is NULL for
+ * memset. Returns non-zero if the operation was done, 0 to fall back to the
+ * plain implementation.
+ */
+typedef int (*mon_bulk_mem_op_t)(void *dest, const void *src, char val,
+				 unsigned int count);
+
+void mon_set_bulk_mem_op(mon_bulk_mem_op_t bulk_mem_op);
+
 #endif
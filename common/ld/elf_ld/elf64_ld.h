@@ -19,9 +19,7 @@
 
 #include "elf_ld.h"
 
-mon_status_t elf64_load_executable(gen_image_access_t *image,
-				   elf_load_info_t *p_info);
-mon_status_t elf64_get_load_info(gen_image_access_t *image,
-				 elf_load_info_t *p_info);
+mon_status_t elf64_load_image(gen_image_access_t *image, uint8_t *p_dest,
+			      uint32_t dest_size, elf_load_info_t *p_info);
 
 #endif                          /* _ELF64_LD_H_ */
@@ -26,14 +26,18 @@
 
 void_t print_string(uint8_t *string);
 /*
- *  FUNCTION  : elf_get_load_info
- *  PURPOSE   : Return ELF image size and machine type
- *  ARGUMENTS : image - describes image and access class
- *            : LOAD_ELF_PARAMS_T *params
- *    RETURNS : MON_OK if success
+ *  FUNCTION  : elf_load_image
+ *  PURPOSE   : Load and relocate ELF-executable to memory in a single pass
+ *            : over its headers, filling load-related data on the way
+ *  ARGUMENTS : gen_image_access_t *image - describes image to load
+ *            : uint8_t    *p_dest    - where to load
+ *            : uint32_t   dest_size  - size of the buffer at p_dest
+ *            : elf_load_info_t *p_info - filled with load-related data
+ *  RETURNS   : MON_OK if success
  */
 static mon_status_t
-elf_get_load_info(gen_image_access_t *image, elf_load_info_t *p_info)
+elf_load_image(gen_image_access_t *image, uint8_t *p_dest,
+	       uint32_t dest_size, elf_load_info_t *p_info)
 {
 	uint8_t *p_buffer;
 	mon_status_t status;
@@ -45,12 +49,13 @@ elf_get_load_info(gen_image_access_t *image, elf_load_info_t *p_info)
 		return MON_ERROR;
 	}
 
+	p_info->copy_section_headers = FALSE;
+	p_info->copy_symbol_tables = FALSE;
+
 	if (elf32_header_is_valid(p_buffer)) {
-		p_info->machine_type = EM_386;
-		status = elf32_get_load_info(image, p_info);
+		status = elf32_load_image(image, p_dest, dest_size, p_info);
 	} else if (elf64_header_is_valid(p_buffer)) {
-		p_info->machine_type = EM_X86_64;
-		status = elf64_get_load_info(image, p_info);
+		status = elf64_load_image(image, p_dest, dest_size, p_info);
 	} else {
 		status = MON_ERROR; /* not ELF */
 	}
@@ -58,52 +63,11 @@ elf_get_load_info(gen_image_access_t *image, elf_load_info_t *p_info)
 	return status;
 }
 
-/*
- *  FUNCTION  : elf_load_executable
- *  PURPOSE   : Load and relocate ELF-executable to memory
- *  ARGUMENTS : gen_image_access_t *image - describes image to load
- *            : elf_load_info_t *p_info - contains load-related data
- *            : uint8_t    *p_dest    - where to load
- *  RETURNS   :
- *  NOTES     : elf_get_load_info() must be called prior this function
- *            : p_dest assumed is pointing on preallocated memory buffer,
- *            : sufficient to contain loaded executable binary
- */
-static mon_status_t
-elf_load_executable(gen_image_access_t *image,
-		    elf_load_info_t *p_info, uint8_t *p_dest)
-{
-	mon_status_t status;
-
-	/* calculate relocation offset */
-	p_info->relocation_offset =
-		(int64_t)((uint64_t)(size_t)p_dest - p_info->start_addr);
-
-	/* and update addresses accordingly */
-	p_info->start_addr += p_info->relocation_offset;
-	p_info->end_addr += p_info->relocation_offset;
-	p_info->entry_addr += p_info->relocation_offset;
-	p_info->sections_addr += p_info->relocation_offset;
-
-	switch (p_info->machine_type) {
-	case EM_386:
-		status = elf32_load_executable(image, p_info);
-		break;
-	case EM_X86_64:
-		status = elf64_load_executable(image, p_info);
-		break;
-	default:
-		status = MON_ERROR;
-		break;
-	}
-
-	return status;
-}
-
 static boolean_t
 load_elf_image(char *p_image,
 	       char *p_target,
-	       size_t image_size, uint64_t *p_entry_point_address)
+	       size_t image_size, uint64_t *p_entry_point_address,
+	       image_info_t *p_image_info)
 {
 	mon_status_t status;
 	gen_image_access_t *image = NULL;
@@ -111,27 +75,26 @@ load_elf_image(char *p_image,
 	mem_image_access_t tmp;
 
 	image = mem_image_create_ex(p_image, image_size, (void *)&tmp);
-	if (NULL != image) {
-		load_info.copy_section_headers = FALSE;
-		load_info.copy_symbol_tables = FALSE;
-
-		status = elf_get_load_info(image, &load_info);
-		if (MON_OK != status) {
-			print_string("elf_get_load_info() failed\n");
-			return FALSE;
-		}
+	if (NULL == image) {
+		return FALSE;
+	}
 
-		status = elf_load_executable(image, &load_info, p_target);
-		if (MON_OK != status) {
-			print_string("elf_load_executable() failed\n");
-			return FALSE;
-		}
-	} else {
+	status = elf_load_image(image, (uint8_t *)p_target,
+		(uint32_t)image_size, &load_info);
+	if (MON_OK != status) {
+		print_string("elf_load_image() failed\n");
 		return FALSE;
 	}
 
 	*p_entry_point_address = load_info.entry_addr;
 
+	if (NULL != p_image_info) {
+		p_image_info->load_size =
+			(uint32_t)(load_info.end_addr - load_info.start_addr);
+		p_image_info->machine_type = (EM_X86_64 == load_info.machine_type) ?
+					     IMAGE_MACHINE_EM64T : IMAGE_MACHINE_X86;
+	}
+
 	return TRUE;
 }
 
@@ -139,56 +102,33 @@ load_elf_image(char *p_image,
 
 /*----------------------------------------------------------------------
  *
- * Get info required for image loading
+ * load image into memory
  *
  * Input:
  * void* file_mapped_into_memory - file directly read or mapped in RAM
+ * void* image_base_address - load image to this address. Must be alined
+ * on 4K.
+ * uint32_t allocated_size - buffer size for image
+ * uint64_t* p_entry_point_address - address of the uint64_t that will be filled
+ * with the address of image entry point if
+ * all is ok
  *
  * Output:
- * image_info_t - fills the structure
- *
- * Return value - image_info_status_t
+ * Return value - FALSE on any error
  *---------------------------------------------------------------------- */
-image_info_status_t get_image_info(const void *file_mapped_into_memory,
-				   uint32_t allocated_size,
-				   image_info_t *p_image_info)
+boolean_t
+load_image(const void *file_mapped_into_memory,
+	   void *image_base_address,
+	   uint32_t allocated_size, uint64_t *p_entry_point_address)
 {
-	mon_status_t status = 0;
-	gen_image_access_t *image = NULL;
-	elf_load_info_t load_info;
-	mem_image_access_t tmp;
-
-	image =
-		mem_image_create_ex((char *)file_mapped_into_memory, allocated_size,
-			(void *)&tmp);
-	if (NULL == image) {
-		return IMAGE_INFO_WRONG_PARAMS;
-	}
-
-	load_info.copy_section_headers = FALSE;
-	load_info.copy_symbol_tables = FALSE;
-
-	status = elf_get_load_info(image, &load_info);
-	if (MON_OK != status) {
-		return IMAGE_INFO_WRONG_FORMAT;
-	}
-
-	p_image_info->load_size = load_info.end_addr - load_info.start_addr;
-
-	if (EM_386 == load_info.machine_type) {
-		p_image_info->machine_type = IMAGE_MACHINE_X86;
-	}
-
-	if (EM_X86_64 == load_info.machine_type) {
-		p_image_info->machine_type = IMAGE_MACHINE_EM64T;
-	}
-
-	return IMAGE_INFO_OK;
+	return load_elf_image((char *)file_mapped_into_memory,
+		(char *)image_base_address, (size_t)allocated_size,
+		p_entry_point_address, NULL);
 }
 
 /*----------------------------------------------------------------------
  *
- * load image into memory
+ * load image into memory and get its info, parsing image headers once
  *
  * Input:
  * void* file_mapped_into_memory - file directly read or mapped in RAM
@@ -200,14 +140,17 @@ image_info_status_t get_image_info(const void *file_mapped_into_memory,
  * all is ok
  *
  * Output:
+ * image_info_t - fills the structure
  * Return value - FALSE on any error
  *---------------------------------------------------------------------- */
 boolean_t
-load_image(const void *file_mapped_into_memory,
-	   void *image_base_address,
-	   uint32_t allocated_size, uint64_t *p_entry_point_address)
+load_image_and_get_info(const void *file_mapped_into_memory,
+			void *image_base_address,
+			uint32_t allocated_size,
+			uint64_t *p_entry_point_address,
+			image_info_t *p_image_info)
 {
 	return load_elf_image((char *)file_mapped_into_memory,
 		(char *)image_base_address, (size_t)allocated_size,
-		p_entry_point_address);
+		p_entry_point_address, p_image_info);
 }
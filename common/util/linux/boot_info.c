@@ -0,0 +1,66 @@
+/*******************************************************************************
+* Copyright (c) 2015 Intel Corporation
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*******************************************************************************/
+#include "mon_defs.h"
+#include "common.h"
+#include "boot_info.h"
+
+static uint64_t boot_info_rdtsc(void)
+{
+	uint64_t tsc;
+
+	__asm__ __volatile__ ("rdtsc" : "=A" (tsc));
+
+	return tsc;
+}
+
+void boot_info_init(boot_info_t *boot_info)
+{
+	mon_memset(boot_info, 0, sizeof(boot_info_t));
+
+	boot_info->signature = BOOT_INFO_SIGNATURE;
+	boot_info->size_of_this_struct = sizeof(boot_info_t);
+	boot_info->version_of_this_struct = BOOT_INFO_VERSION;
+}
+
+/* Return boot info at the given address, or NULL if it is not initialized */
+boot_info_t *boot_info_validate(uint32_t addr)
+{
+	boot_info_t *boot_info = (boot_info_t *)addr;
+
+	if ((boot_info == NULL) ||
+	    (boot_info->signature != BOOT_INFO_SIGNATURE) ||
+	    (boot_info->size_of_this_struct != sizeof(boot_info_t))) {
+		return NULL;
+	}
+
+	return boot_info;
+}
+
+/* Timestamp the event. Events are dropped when the timeline is full. */
+void boot_info_record(boot_info_t *boot_info, boot_event_t event)
+{
+	boot_timeline_entry_t *entry;
+
+	if ((boot_info == NULL) ||
+	    (boot_info->timeline_count >= BOOT_TIMELINE_MAX_ENTRIES)) {
+		return;
+	}
+
+	entry = &boot_info->timeline[boot_info->timeline_count];
+	entry->event = event;
+	entry->tsc = boot_info_rdtsc();
+	boot_info->timeline_count++;
+}
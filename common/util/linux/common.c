@@ -14,16 +14,93 @@
 * limitations under the License.
 *******************************************************************************/
 #include "common.h"
+
+/* Below this size the setup of dword string operations does not pay off */
+#define STRING_OP_DWORD_THRESHOLD 64
+
+#define CPUID_LEAF_EXT_FEATURES 7
+#define CPUID_7_EBX_ERMSB (1 << 9)     /* Enhanced REP MOVSB/STOSB */
+
+/* From this size on mon_memset()/mon_memcpy() go to the bulk handler */
+#define BULK_MEM_OP_THRESHOLD 0x40000
+
+/* -1 - not detected yet, 0 - use dword operations, 1 - use ERMSB */
+static int ermsb_supported = -1;
+
+static mon_bulk_mem_op_t bulk_mem_op;
+
+void mon_set_bulk_mem_op(mon_bulk_mem_op_t op)
+{
+	bulk_mem_op = op;
+}
+
+static void string_op_cpuid(unsigned int leaf, unsigned int regs[4])
+{
+	__asm__ __volatile__ (
+		"pushl %%ebx      \n\t"
+		"cpuid            \n\t"
+		"movl %%ebx, %1   \n\t"
+		"popl %%ebx       \n\t"
+		: "=a" (regs[0]), "=r" (regs[1]), "=c" (regs[2]), "=d" (regs[3])
+		: "a" (leaf), "c" (0)
+		: "cc"
+		);
+}
+
+/*
+ * ERMSB makes rep movsb/stosb the fastest way for any size and alignment,
+ * otherwise dword string operations with byte head and tail are used.
+ */
+static int use_ermsb(void)
+{
+	unsigned int regs[4];
+
+	if (ermsb_supported < 0) {
+		string_op_cpuid(0, regs);
+		ermsb_supported = 0;
+
+		if (regs[0] >= CPUID_LEAF_EXT_FEATURES) {
+			string_op_cpuid(CPUID_LEAF_EXT_FEATURES, regs);
+			ermsb_supported = (regs[1] & CPUID_7_EBX_ERMSB) ? 1 : 0;
+		}
+	}
+
+	return ermsb_supported;
+}
+
 void *mon_memset(void *dest, char val, unsigned int count)
 {
+	unsigned int head = 0;
+	unsigned int dwords = 0;
+	unsigned int fill = (unsigned char)val;
+	void *d = dest;
+
+	if ((count >= BULK_MEM_OP_THRESHOLD) && (bulk_mem_op != 0) &&
+	    bulk_mem_op(dest, 0, val, count)) {
+		return dest;
+	}
+
+	if ((count >= STRING_OP_DWORD_THRESHOLD) && !use_ermsb()) {
+		/* align destination to dword */
+		head = (0 - (unsigned int)dest) & 3;
+		dwords = (count - head) >> 2;
+		count = (count - head) & 3;
+		fill *= 0x01010101;
+	} else {
+		head = count;
+		count = 0;
+	}
+
 	__asm__ __volatile__ (
-		"movl %0, %%edi\n"
-		"movl %1, %%eax\n"
-		"movl %2, %%ecx\n"
-		"cld; rep; stosb"
-		:
-		: "g" (dest), "g" (val), "g" (count)
-		: "edi", "eax", "ecx", "memory"
+		"cld\n"
+		"rep; stosb\n"
+		"movl %3, %%ecx\n"
+		"rep; stosl\n"
+		"movl %4, %%ecx\n"
+		"rep; stosb"
+		: "+D" (d), "+c" (head)
+		: "a" (fill), "g" (dwords), "g" (count)
+		: "memory"
 		);
 
 	return dest;
@@ -31,14 +108,36 @@ void *mon_memset(void *dest, char val, unsigned int count)
 
 void *mon_memcpy(void *dest, const void *src, unsigned int count)
 {
+	unsigned int head = 0;
+	unsigned int dwords = 0;
+	void *d = dest;
+	const void *s = src;
+
+	if ((count >= BULK_MEM_OP_THRESHOLD) && (bulk_mem_op != 0) &&
+	    bulk_mem_op(dest, src, 0, count)) {
+		return dest;
+	}
+
+	if ((count >= STRING_OP_DWORD_THRESHOLD) && !use_ermsb()) {
+		/* align destination to dword, unaligned source reads are cheap */
+		head = (0 - (unsigned int)dest) & 3;
+		dwords = (count - head) >> 2;
+		count = (count - head) & 3;
+	} else {
+		head = count;
+		count = 0;
+	}
+
 	__asm__ __volatile__ (
-		"movl %0, %%edi\n"
-		"movl %1, %%esi\n"
-		"movl %2, %%ecx\n"
-		"cld; rep; movsb"
-		:
-		: "g" (dest), "g" (src), "g" (count)
-		: "edi", "esi", "ecx", "memory"
+		"cld\n"
+		"rep; movsb\n"
+		"movl %3, %%ecx\n"
+		"rep; movsl\n"
+		"movl %4, %%ecx\n"
+		"rep; movsb"
+		: "+D" (d), "+S" (s), "+c" (head)
+		: "g" (dwords), "g" (count)
+		: "memory"
 		);
 
 	return dest;
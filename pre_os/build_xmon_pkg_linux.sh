@@ -72,6 +72,21 @@ for x in $files; do
     cp $x .
 done
 
+#############################################################################
+# Optionally compress startap and xmon (LZ4 legacy format), xmon loader
+# expands them before loading. Usage: XMON_PKG_COMPRESS=lz4 ./build_...
+#############################################################################
+
+if [ "$XMON_PKG_COMPRESS" == "lz4" ]; then
+    for x in startap.elf $2; do
+        lz4 -l -9 -f -q $x $x.lz4 && mv -f $x.lz4 $x
+        if [ $? -ne 0 ]; then
+            echo "  Can't compress $x."
+            exit
+        fi
+    done
+fi
+
 #############################################################################
 # Convert text to hex
 #############################################################################
@@ -21,6 +21,7 @@
 #include "mon_startup.h"
 #include "xmon_desc.h"
 #include "common.h"
+#include "boot_info.h"
 
 int run_xmon_loader(xmon_desc_t *td);
 
@@ -298,6 +299,10 @@ void starter_main(uint32_t eflags,
 	eip1 = (uint32_t)RETURN_ADDRESS();
 	td = (xmon_desc_t *)((eip1 & 0xffffff00) - 0x400);
 
+	boot_info_init((boot_info_t *)BOOT_INFO_BASE(td));
+	boot_info_record((boot_info_t *)BOOT_INFO_BASE(td),
+		BOOT_EVENT_STARTER_ENTRY);
+
 	mon_memset((void *)GUEST1_BASE(td),
 		0, XMON_LOADER_BASE(td) - GUEST1_BASE(td)
 		);
@@ -46,7 +46,9 @@ typedef struct {
  *
  *        Load time                        xmon up running
  * +----------------------+ 6MB       +----------------------+ 6MB
- * |                      |           |                      |
+ * |                      |           | AP runtime (PT, GDT, |
+ * |                      |           | AP stacks)           |
+ * |                      |           +----------------------+
  * |                      |           | xmon heap            |
  * |                      |           |                      |
  * |                      |           +----------------------+
@@ -54,7 +56,9 @@ typedef struct {
  * |                      |           +----------------------+
  * |                      |           | xmon (~400 KB)       |
  * |                      |           +----------------------+
- * |                      |           | startap (12 KB)      |
+ * |                      |           | boot info (4 KB)     |
+ * |                      |           +----------------------+
+ * |                      |           | startap (32 KB)      |
  * +----------------------+           +----------------------+
  * | loader heap (512 KB) |           |                      |
  * +----------------------+           |                      |
@@ -79,8 +83,11 @@ typedef struct {
 
 /* xmon and startap memory map */
 #define STARTAP_BASE(td) ((XMON_LOADER_HEAP_BASE(td) + XMON_LOADER_HEAP_SIZE))
-#define STARTAP_SIZE (0x3000)
-#define XMON_BASE(td) (STARTAP_BASE(td) + STARTAP_SIZE)
+#define STARTAP_SIZE (0x8000)
+/* boot timeline, see boot_info.h */
+#define BOOT_INFO_BASE(td) (STARTAP_BASE(td) + STARTAP_SIZE)
+#define BOOT_INFO_SIZE (0x1000)
+#define XMON_BASE(td) (BOOT_INFO_BASE(td) + BOOT_INFO_SIZE)
 /*
  * not reuse the memory of loader heap, xmon loader, states and loader_bin
  * to make sure we can resume to lanuch linux kernel
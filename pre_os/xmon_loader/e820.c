@@ -247,6 +247,7 @@ boolean_t hide_runtime_memory(multiboot_info_t *mbi,
 			if (mmap->type != MULTIBOOT_MEMORY_AVAILABLE) {
 				print_string(
 					"ERROR: the type of memory to hide is not AVAILABLE in e820 table!!\n");
+				free_memory(newmmap_addr);
 				return FALSE;
 			}
 
@@ -266,6 +267,7 @@ boolean_t hide_runtime_memory(multiboot_info_t *mbi,
 			    (mmap->addr + mmap->len)) {
 				print_string(
 					"ERROR: hide_mem_addr+hide_mem_size crossing two E820 entries!!\n");
+				free_memory(newmmap_addr);
 				return FALSE;
 			}
 
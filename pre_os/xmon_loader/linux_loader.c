@@ -24,6 +24,7 @@
 #include "error_code.h"
 #include "memory.h"
 #include "mon_startup.h"
+#include "xmon_loader.h"
 
 
 /*
@@ -166,10 +167,175 @@ uint32_t strlen(const char *str)
 	return s - str;
 }
 
+/*
+ * append 'len' chars of 'param' to cmdline.
+ * cmdline_size is the max length of cmdline without the terminating zero.
+ */
+static bool_t append_cmdline(char *cmdline, uint32_t cmdline_size,
+			     const char *param, uint32_t len)
+{
+	if (strlen(cmdline) + len > cmdline_size) {
+		print_string("WARN: no room on cmdline to append a parameter\n");
+		return false;
+	}
+
+	mon_memcpy(cmdline + strlen(cmdline), param, len);
+
+	return true;
+}
+
+/*
+ * append " <name>0x<value>" to cmdline.
+ */
+static bool_t append_cmdline_hex(char *cmdline, uint32_t cmdline_size,
+				 const char *name, uint32_t value)
+{
+	static const char hex_digits[] = "0123456789abcdef";
+	char buf[64];
+	uint32_t len = 0;
+	uint32_t name_len = strlen(name);
+	int shift;
+
+	if (name_len + 12 > sizeof(buf)) {
+		return false;
+	}
+
+	buf[len++] = ' ';
+	mon_memcpy(&buf[len], name, name_len);
+	len += name_len;
+	buf[len++] = '0';
+	buf[len++] = 'x';
+
+	for (shift = 28; shift > 0; shift -= 4) {
+		if ((value >> shift) != 0) {
+			break;
+		}
+	}
+	for (; shift >= 0; shift -= 4)
+		buf[len++] = hex_digits[(value >> shift) & 0xf];
+
+	return append_cmdline(cmdline, cmdline_size, buf, len);
+}
+
+/*
+ * append " <name><value>" to cmdline, value in decimal.
+ */
+static bool_t append_cmdline_dec(char *cmdline, uint32_t cmdline_size,
+				 const char *name, uint32_t value)
+{
+	char buf[64];
+	char digits[10];
+	uint32_t len = 0;
+	uint32_t name_len = strlen(name);
+	uint32_t count = 0;
+
+	if (name_len + 11 > sizeof(buf)) {
+		return false;
+	}
+
+	buf[len++] = ' ';
+	mon_memcpy(&buf[len], name, name_len);
+	len += name_len;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value != 0);
+
+	while (count != 0)
+		buf[len++] = digits[--count];
+
+	return append_cmdline(cmdline, cmdline_size, buf, len);
+}
+
+/*
+ * hand the TSC calibration of startap to the guest, so it does not calibrate
+ * again. Rough calibrations against port 0x80 delays are not passed, and the
+ * parameters given by the user are kept.
+ */
+static void append_cmdline_tsc(char *cmdline, uint32_t cmdline_size,
+			       const boot_info_t *boot_info)
+{
+	if ((boot_info->tsc_ticks_per_msec != 0) &&
+	    (boot_info->tsc_source != BOOT_TSC_SOURCE_NONE) &&
+	    (boot_info->tsc_source != BOOT_TSC_SOURCE_IO_DELAY) &&
+	    (find_cmdline_param(cmdline, "tsc_early_khz=") == NULL)) {
+		/* ticks per millisecond is the frequency in kHz */
+		append_cmdline_dec(cmdline, cmdline_size, "tsc_early_khz=",
+			boot_info->tsc_ticks_per_msec);
+	}
+
+	/* startap found no skew between CPUs */
+	if (boot_info->tsc_reliable &&
+	    (find_cmdline_param(cmdline, "tsc=") == NULL)) {
+		append_cmdline(cmdline, cmdline_size, " tsc=reliable", 13);
+	}
+}
+
+/*
+ * check whether the initrd module can be passed to the kernel where the
+ * boot loader put it: it must be page aligned, below initrd_addr_max,
+ * out of the kernel init_size footprint and inside AVAILABLE RAM (hidden
+ * xmon memory is already marked reserved in the memory map).
+ * A relocatable kernel first moves itself up to kernel_alignment and then
+ * decompresses over init_size, or it may run at pref_address, so both
+ * footprints are checked.
+ */
+static bool_t initrd_usable_in_place(multiboot_info_t *mbi,
+				     linux_kernel_header_t *hdr,
+				     uint32_t initrd_addr, uint32_t initrd_size,
+				     uint32_t protected_mode_base,
+				     uint32_t prot_size)
+{
+	uint64_t initrd_end = (uint64_t)initrd_addr + initrd_size;
+	uint64_t kernel_align = hdr->setup_hdr.kernel_alignment;
+	uint64_t kernel_end = protected_mode_base;
+	uint64_t pref_base = hdr->setup_hdr.pref_address;
+	uint64_t pref_end = pref_base + PAGE_ALIGN_4K(prot_size);
+	multiboot_memory_map_t *mmap = (multiboot_memory_map_t *)(mbi->mmap_addr);
+	unsigned int i;
+
+	if (kernel_align > 1) {
+		kernel_end = (kernel_end + kernel_align - 1) & ~(kernel_align - 1);
+	}
+	kernel_end += PAGE_ALIGN_4K(prot_size);
+
+	if ((initrd_addr & PAGE_4KB_MASK) != 0) {
+		return false;
+	}
+
+	if (initrd_end > hdr->setup_hdr.initrd_addr_max) {
+		return false;
+	}
+
+	if ((initrd_addr < kernel_end) && (protected_mode_base < initrd_end)) {
+		return false;
+	}
+
+	if ((initrd_addr < pref_end) && (pref_base < initrd_end)) {
+		return false;
+	}
+
+	if (!(mbi->flags & MBI_MEMMAP)) {
+		return false;
+	}
+
+	for (i = 0; i < mbi->mmap_length / sizeof(multiboot_memory_map_t); i++) {
+		if ((mmap[i].type == MULTIBOOT_MEMORY_AVAILABLE) &&
+		    (mmap[i].addr <= initrd_addr) &&
+		    (initrd_end <= mmap[i].addr + mmap[i].len)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /* expand linux kernel with kernel image and initrd image */
 static bool_t expand_linux_image(multiboot_info_t *mbi,
 				 const void *linux_image, size_t linux_size,
 				 const void *initrd_image, size_t initrd_size,
+				 boot_info_t *boot_info,
 				 unsigned int *boot_param_addr,
 				 unsigned int *entry_point)
 {
@@ -242,9 +408,10 @@ static bool_t expand_linux_image(multiboot_info_t *mbi,
 
 	/* allocate "boot_params+cmdline" from heap space.
 	 *  and zero them (already zeroed in allocate_memory()).
+	 *  cmdline_size does not include the terminating zero.
 	 */
 	boot_params = (boot_params_t *)allocate_memory(
-		sizeof(boot_params_t) + hdr->setup_hdr.cmdline_size);
+		sizeof(boot_params_t) + hdr->setup_hdr.cmdline_size + 1);
 	if (boot_params == NULL) {
 		print_string("Allocate memory for linux boot_params failed\n");
 		return false;
@@ -278,42 +445,6 @@ static bool_t expand_linux_image(multiboot_info_t *mbi,
 	 */
 	hdr->setup_hdr.loadflags &= ~FLAG_CAN_USE_HEAP; /* can not use heap */
 
-	if ((initrd_image !=  0) && (initrd_size != 0)) {
-		/* load initrd and set ramdisk_image and ramdisk_size
-		 *  The initrd should typically be located as high in memory as possible
-		 *
-		 *  check if Linux command line explicitly specified a memory limit
-		 *  TODO: hardcode here to 4GB. (call get_cmdline_str_value() to get
-		 *  "mem=" limit value (not supported right now)
-		 */
-		uint64_t mem_limit = 0x100000000ULL;
-		uint64_t max_ram_base, max_ram_size;
-
-		get_highest_sized_ram(mbi, initrd_size, mem_limit,
-			&max_ram_base, &max_ram_size);
-
-		if (max_ram_base == 0) {
-			return false;
-		}
-		if (max_ram_size == 0) {
-			return false;
-		}
-
-		/*
-		 *  try to get the higher part in an AVAILABLE memory range
-		 *  and clear lower 12 bit to make it page-aligned down.
-		 */
-		initrd_base = (max_ram_base + max_ram_size - initrd_size) & (~PAGE_4KB_MASK);
-
-		/* exceed initrd_addr_max specified in vmlinuz header? */
-		if (initrd_base + initrd_size > hdr->setup_hdr.initrd_addr_max) {
-			/* make it much lower, if exceed it */
-			initrd_base = hdr->setup_hdr.initrd_addr_max - initrd_size;
-			initrd_base = initrd_base & (~PAGE_4KB_MASK);
-		}
-	}
-
-
 	if (hdr->setup_hdr.relocatable_kernel) {
 		/* A relocatable kernel that is loaded at an alignment
 		 * incompatible value will be realigned during kernel
@@ -335,15 +466,55 @@ static bool_t expand_linux_image(multiboot_info_t *mbi,
 
 
 	if ((initrd_image != 0) && (initrd_size != 0)) {
-		/* make sure no overlap between initrd and protected mode kernel code */
-		if ((protected_mode_base + PAGE_ALIGN_4K(prot_size)) > initrd_base) {
-			print_string(
-				"ERROR: Initrd size is too large (or protected mode code size is too large)\n");
-			return false;
-		}
+		if (initrd_usable_in_place(mbi, hdr, (uint32_t)initrd_image,
+			    initrd_size, protected_mode_base, prot_size)) {
+			/* no need to move the initrd, hand it over where it is */
+			initrd_base = (uint32_t)initrd_image;
+		} else {
+			/* load initrd and set ramdisk_image and ramdisk_size
+			 *  The initrd should typically be located as high in memory as possible
+			 *
+			 *  check if Linux command line explicitly specified a memory limit
+			 *  TODO: hardcode here to 4GB. (call get_cmdline_str_value() to get
+			 *  "mem=" limit value (not supported right now)
+			 */
+			uint64_t mem_limit = 0x100000000ULL;
+			uint64_t max_ram_base, max_ram_size;
+
+			get_highest_sized_ram(mbi, initrd_size, mem_limit,
+				&max_ram_base, &max_ram_size);
+
+			if (max_ram_base == 0) {
+				return false;
+			}
+			if (max_ram_size == 0) {
+				return false;
+			}
 
-		/* relocate initrd image to higher end location. */
-		mon_memcpy((void *)initrd_base, initrd_image, initrd_size);
+			/*
+			 *  try to get the higher part in an AVAILABLE memory range
+			 *  and clear lower 12 bit to make it page-aligned down.
+			 */
+			initrd_base = (max_ram_base + max_ram_size - initrd_size) &
+				      (~PAGE_4KB_MASK);
+
+			/* exceed initrd_addr_max specified in vmlinuz header? */
+			if (initrd_base + initrd_size > hdr->setup_hdr.initrd_addr_max) {
+				/* make it much lower, if exceed it */
+				initrd_base = hdr->setup_hdr.initrd_addr_max - initrd_size;
+				initrd_base = initrd_base & (~PAGE_4KB_MASK);
+			}
+
+			/* make sure no overlap between initrd and protected mode kernel code */
+			if ((protected_mode_base + PAGE_ALIGN_4K(prot_size)) > initrd_base) {
+				print_string(
+					"ERROR: Initrd size is too large (or protected mode code size is too large)\n");
+				return false;
+			}
+
+			/* relocate initrd image to higher end location. */
+			mon_memcpy((void *)initrd_base, initrd_image, initrd_size);
+		}
 
 		hdr->setup_hdr.ramdisk_image = initrd_base;
 		hdr->setup_hdr.ramdisk_size = initrd_size;
@@ -380,6 +551,15 @@ static bool_t expand_linux_image(multiboot_info_t *mbi,
 	mon_memcpy((void *)hdr->setup_hdr.cmd_line_ptr, kernel_cmdline,
 		strlen(kernel_cmdline));
 
+	/* let the guest find the boot timeline */
+	if (boot_info != NULL) {
+		append_cmdline_hex((char *)hdr->setup_hdr.cmd_line_ptr,
+			hdr->setup_hdr.cmdline_size,
+			"xmon_boot_info=", (uint32_t)boot_info);
+		append_cmdline_tsc((char *)hdr->setup_hdr.cmd_line_ptr,
+			hdr->setup_hdr.cmdline_size, boot_info);
+	}
+
 
 	/* setup boot parameters according to linux boot protocol */
 	if (false == setup_boot_params(mbi, boot_params, hdr)) {
@@ -439,7 +619,7 @@ bool_t jump_linux_image(unsigned int bootparams, unsigned int entry_point)
  * 3) prepare the boot_prames to jump linux kernel
  *
  */
-void launch_linux_kernel(multiboot_info_t *mbi)
+void launch_linux_kernel(multiboot_info_t *mbi, boot_info_t *boot_info)
 {
 	unsigned int kernel_entry_point;
 	unsigned int boot_param_addr;
@@ -471,12 +651,17 @@ void launch_linux_kernel(multiboot_info_t *mbi)
 	if (false == expand_linux_image(mbi,
 		    kernel_image, kernel_size,
 		    initrd_image, initrd_size,
+		    boot_info,
 		    &boot_param_addr,
 		    &kernel_entry_point)) {
 		print_string("ERROR: Failed to expand linux image\n");
 		return;
 	}
 
+	/* the loader heap is not used after this point */
+	print_heap_usage();
+
+	boot_info_record(boot_info, BOOT_EVENT_LINUX_LAUNCH);
 	jump_linux_image(boot_param_addr, kernel_entry_point);
 
 
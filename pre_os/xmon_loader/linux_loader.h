@@ -19,6 +19,7 @@
 
 #include "multiboot1.h"
 #include "xmon_desc.h"
+#include "boot_info.h"
 
 
 #define E820_RESERVED_MEM       2
@@ -204,6 +205,6 @@ typedef struct  {
 
 
 
-void launch_linux_kernel(multiboot_info_t *mbi);
+void launch_linux_kernel(multiboot_info_t *mbi, boot_info_t *boot_info);
 
 #endif
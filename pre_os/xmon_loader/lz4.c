@@ -0,0 +1,178 @@
+/*******************************************************************************
+* Copyright (c) 2015 Intel Corporation
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*******************************************************************************/
+
+#include "mon_defs.h"
+#include "common.h"
+#include "xmon_loader.h"
+#include "screen.h"
+#include "lz4.h"
+
+#define LZ4_MIN_MATCH 4
+
+static uint32_t read_le32(const uint8_t *p)
+{
+	return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Read LZ4 variable length extension of 'len', return FALSE on overrun */
+static boolean_t read_length(const uint8_t **ip, const uint8_t *iend,
+			     uint32_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend) {
+			return FALSE;
+		}
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 0xff);
+
+	return TRUE;
+}
+
+/*
+ * Decompress a single LZ4 block.
+ * Return the number of bytes written to dst, or -1 on malformed input or
+ * output overflow.
+ */
+static int32_t lz4_decompress_block(const uint8_t *src, uint32_t src_size,
+				    uint8_t *dst, uint32_t dst_size)
+{
+	const uint8_t *ip = src;
+	const uint8_t *iend = src + src_size;
+	uint8_t *op = dst;
+	uint8_t *oend = dst + dst_size;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		uint32_t len = token >> 4;
+		uint32_t offset;
+		const uint8_t *match;
+
+		/* literals */
+		if ((len == 15) && !read_length(&ip, iend, &len)) {
+			return -1;
+		}
+
+		if ((len > (uint32_t)(iend - ip)) || (len > (uint32_t)(oend - op))) {
+			return -1;
+		}
+
+		mon_memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		/* the last sequence has literals only */
+		if (ip == iend) {
+			break;
+		}
+
+		/* match */
+		if (iend - ip < 2) {
+			return -1;
+		}
+
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if ((offset == 0) || (offset > (uint32_t)(op - dst))) {
+			return -1;
+		}
+
+		len = token & 0xf;
+		if ((len == 15) && !read_length(&ip, iend, &len)) {
+			return -1;
+		}
+		len += LZ4_MIN_MATCH;
+
+		if (len > (uint32_t)(oend - op)) {
+			return -1;
+		}
+
+		match = op - offset;
+		if (offset >= len) {
+			mon_memcpy(op, match, len);
+			op += len;
+		} else {
+			/* overlapping match repeats the last 'offset' bytes */
+			while (len--)
+				*op++ = *match++;
+		}
+	}
+
+	return (int32_t)(op - dst);
+}
+
+boolean_t lz4_is_compressed(const void *src, uint32_t src_size)
+{
+	return (src_size >= sizeof(uint32_t)) &&
+	       (read_le32((const uint8_t *)src) == LZ4_LEGACY_MAGIC);
+}
+
+/*
+ * Decompress LZ4 legacy frame(s) from src to dst.
+ * src_size may include trailing zero padding (e.g. up to a sector size).
+ * Return decompressed size, or 0 on malformed input or if dst is too small.
+ */
+uint32_t lz4_decompress(const void *src, uint32_t src_size,
+			void *dst, uint32_t dst_size)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *iend = ip + src_size;
+	uint8_t *op = (uint8_t *)dst;
+	uint32_t out_size = 0;
+
+	if (!lz4_is_compressed(src, src_size)) {
+		return 0;
+	}
+	ip += sizeof(uint32_t);
+
+	while (iend - ip >= (int32_t)sizeof(uint32_t)) {
+		uint32_t block_size = read_le32(ip);
+		int32_t block_out;
+
+		ip += sizeof(uint32_t);
+
+		/* zero padding after the last block */
+		if (block_size == 0) {
+			break;
+		}
+
+		/* concatenated frame */
+		if (block_size == LZ4_LEGACY_MAGIC) {
+			continue;
+		}
+
+		if (block_size > (uint32_t)(iend - ip)) {
+			PRINT_STRING("LZ4: truncated block\n");
+			return 0;
+		}
+
+		block_out = lz4_decompress_block(ip, block_size,
+			op + out_size, dst_size - out_size);
+		if (block_out < 0) {
+			PRINT_STRING("LZ4: corrupted block\n");
+			return 0;
+		}
+
+		ip += block_size;
+		out_size += block_out;
+	}
+
+	return out_size;
+}
@@ -0,0 +1,28 @@
+/*******************************************************************************
+* Copyright (c) 2015 Intel Corporation
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*******************************************************************************/
+
+#ifndef LZ4_H
+#define LZ4_H
+
+/* LZ4 legacy frame format, as produced by "lz4 -l" */
+#define LZ4_LEGACY_MAGIC 0x184C2102
+
+boolean_t lz4_is_compressed(const void *src, uint32_t src_size);
+
+uint32_t lz4_decompress(const void *src, uint32_t src_size,
+			void *dst, uint32_t dst_size);
+
+#endif    /* LZ4_H */
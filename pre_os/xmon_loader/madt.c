@@ -0,0 +1,273 @@
+/*******************************************************************************
+* Copyright (c) 2015 Intel Corporation
+*
+* Licensed under the Apache License, Version 2.0 (the "License");
+* you may not use this file except in compliance with the License.
+* You may obtain a copy of the License at
+*
+*      http://www.apache.org/licenses/LICENSE-2.0
+*
+* Unless required by applicable law or agreed to in writing, software
+* distributed under the License is distributed on an "AS IS" BASIS,
+* WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+* See the License for the specific language governing permissions and
+* limitations under the License.
+*******************************************************************************/
+
+#include "mon_defs.h"
+#include "xmon_loader.h"
+#include "screen.h"
+
+/* ACPI signatures */
+#define RSDP_SIG_LO 0x20445352          /* "RSD " */
+#define RSDP_SIG_HI 0x20525450          /* "PTR " */
+#define XSDT_SIG    0x54445358          /* "XSDT" */
+#define RSDT_SIG    0x54445352          /* "RSDT" */
+#define MADT_SIG    0x43495041          /* "APIC" */
+
+#define EBDA_SEGMENT_PTR   0x40e
+#define EBDA_SEARCH_SIZE   0x400
+#define BIOS_ROM_START     0xe0000
+#define BIOS_ROM_END       0xfffff
+
+#define MADT_TYPE_LOCAL_APIC      0
+#define MADT_TYPE_LOCAL_X2APIC    9
+#define MADT_APIC_ENABLED         0x1
+
+typedef struct {
+	uint32_t sig_lo;
+	uint32_t sig_hi;
+	uint8_t cksum;
+	uint8_t oem_id[6];
+	uint8_t rev;
+	uint32_t rsdt_addr;
+	uint32_t len;
+	uint64_t xsdt_addr;
+	uint8_t ext_cksum;
+	uint8_t reserved[3];
+} __attribute__ ((packed)) acpi_rsdp_t;
+
+typedef struct {
+	uint32_t sig;
+	uint32_t len;
+	uint8_t rev;
+	uint8_t cksum;
+	uint8_t oem_id[6];
+	uint8_t oem_tab_id[8];
+	uint32_t oem_rev;
+	uint32_t creator_id;
+	uint32_t creator_rev;
+} __attribute__ ((packed)) acpi_header_t;
+
+typedef struct {
+	acpi_header_t hdr;
+	uint32_t local_apic_addr;
+	uint32_t flags;
+} __attribute__ ((packed)) acpi_madt_t;
+
+typedef struct {
+	uint8_t type;
+	uint8_t len;
+} __attribute__ ((packed)) madt_entry_header_t;
+
+typedef struct {
+	madt_entry_header_t hdr;
+	uint8_t acpi_id;
+	uint8_t apic_id;
+	uint32_t flags;
+} __attribute__ ((packed)) madt_local_apic_t;
+
+typedef struct {
+	madt_entry_header_t hdr;
+	uint16_t reserved;
+	uint32_t x2apic_id;
+	uint32_t flags;
+	uint32_t acpi_uid;
+} __attribute__ ((packed)) madt_local_x2apic_t;
+
+static boolean_t acpi_checksum_ok(const void *table, uint32_t size)
+{
+	const uint8_t *p = (const uint8_t *)table;
+	uint8_t sum = 0;
+
+	while (size--)
+		sum += *p++;
+
+	return sum == 0;
+}
+
+/* Find RSDP between 'start' and 'end'. Searching is done on 16-byte boundary */
+static acpi_rsdp_t *find_rsdp(uint32_t start, uint32_t end)
+{
+	uint32_t addr;
+
+	for (addr = start; addr + sizeof(acpi_rsdp_t) <= end; addr += 16) {
+		acpi_rsdp_t *rsdp = (acpi_rsdp_t *)addr;
+
+		if ((rsdp->sig_lo != RSDP_SIG_LO) ||
+		    (rsdp->sig_hi != RSDP_SIG_HI) ||
+		    !acpi_checksum_ok(rsdp, 20)) {
+			continue;
+		}
+
+		/* ACPI 2.0+ RSDP has extended checksum over its whole length */
+		if ((rsdp->rev >= 2) &&
+		    ((rsdp->len < sizeof(acpi_rsdp_t)) ||
+		     (addr + rsdp->len > end) ||
+		     !acpi_checksum_ok(rsdp, rsdp->len))) {
+			continue;
+		}
+
+		return rsdp;
+	}
+
+	return NULL;
+}
+
+/* Look for MADT in the entries of XSDT (entry_size 8) or RSDT (entry_size 4) */
+static acpi_header_t *find_madt_in_sdt(acpi_header_t *sdt, uint32_t sig,
+				       uint32_t entry_size)
+{
+	uint32_t count;
+	uint32_t i;
+
+	if ((sdt == NULL) || (sdt->sig != sig) ||
+	    (sdt->len < sizeof(acpi_header_t)) ||
+	    !acpi_checksum_ok(sdt, sdt->len)) {
+		return NULL;
+	}
+
+	count = (sdt->len - sizeof(acpi_header_t)) / entry_size;
+
+	for (i = 0; i < count; i++) {
+		uint8_t *entry = (uint8_t *)(sdt + 1) + i * entry_size;
+		acpi_header_t *hdr;
+
+		/* upper half of XSDT entries must be zero to be reachable */
+		if ((entry_size == sizeof(uint64_t)) &&
+		    (((uint32_t *)entry)[1] != 0)) {
+			continue;
+		}
+
+		hdr = (acpi_header_t *)(*(uint32_t *)entry);
+		if ((hdr != NULL) && (hdr->sig == MADT_SIG) &&
+		    acpi_checksum_ok(hdr, hdr->len)) {
+			return hdr;
+		}
+	}
+
+	return NULL;
+}
+
+static acpi_header_t *find_madt(acpi_rsdp_t *rsdp)
+{
+	acpi_header_t *madt = NULL;
+
+	/* XSDT is used only if it is reachable from 32-bit code. If it is
+	 * missing or broken, fall back to RSDT */
+	if ((rsdp->rev >= 2) && (rsdp->xsdt_addr != 0) &&
+	    (rsdp->xsdt_addr < 0x100000000ULL)) {
+		madt = find_madt_in_sdt(
+			(acpi_header_t *)(uint32_t)rsdp->xsdt_addr,
+			XSDT_SIG, sizeof(uint64_t));
+	}
+
+	if (madt == NULL) {
+		madt = find_madt_in_sdt((acpi_header_t *)rsdp->rsdt_addr,
+			RSDT_SIG, sizeof(uint32_t));
+	}
+
+	return madt;
+}
+
+static boolean_t apic_id_listed(const uint32_t *apic_ids, uint32_t count,
+				uint32_t apic_id)
+{
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (apic_ids[i] == apic_id) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+ * Get local APIC IDs of all enabled APs from ACPI MADT.
+ * The BSP (bsp_apic_id) is not included in the list.
+ * Return 0 on success, -1 if MADT is not found or lists more APs than
+ * 'max_ids'.
+ */
+int get_ap_apic_ids_from_madt(uint32_t bsp_apic_id, uint32_t *apic_ids,
+			      uint32_t max_ids, uint32_t *count)
+{
+	acpi_rsdp_t *rsdp;
+	acpi_header_t *madt;
+	uint32_t ebda;
+	uint32_t next;
+	uint32_t end;
+	uint32_t num = 0;
+
+	ebda = (uint32_t)(*(uint16_t *)EBDA_SEGMENT_PTR) << 4;
+	rsdp = (ebda != 0) ? find_rsdp(ebda, ebda + EBDA_SEARCH_SIZE) : NULL;
+
+	if (rsdp == NULL) {
+		rsdp = find_rsdp(BIOS_ROM_START, BIOS_ROM_END + 1);
+	}
+
+	if (rsdp == NULL) {
+		PRINT_STRING("LOADER: ACPI RSDP not found\n");
+		return -1;
+	}
+
+	madt = find_madt(rsdp);
+	if (madt == NULL) {
+		PRINT_STRING("LOADER: ACPI MADT not found\n");
+		return -1;
+	}
+
+	next = (uint32_t)madt + sizeof(acpi_madt_t);
+	end = (uint32_t)madt + madt->len;
+
+	while (next + sizeof(madt_entry_header_t) <= end) {
+		madt_entry_header_t *entry = (madt_entry_header_t *)next;
+		uint32_t apic_id;
+		uint32_t flags;
+
+		if (entry->len < sizeof(madt_entry_header_t)) {
+			return -1;
+		}
+
+		if (entry->type == MADT_TYPE_LOCAL_APIC) {
+			apic_id = ((madt_local_apic_t *)entry)->apic_id;
+			flags = ((madt_local_apic_t *)entry)->flags;
+		} else if (entry->type == MADT_TYPE_LOCAL_X2APIC) {
+			apic_id = ((madt_local_x2apic_t *)entry)->x2apic_id;
+			flags = ((madt_local_x2apic_t *)entry)->flags;
+		} else {
+			next += entry->len;
+			continue;
+		}
+
+		next += entry->len;
+
+		if (((flags & MADT_APIC_ENABLED) == 0) || (apic_id == bsp_apic_id) ||
+		    apic_id_listed(apic_ids, num, apic_id)) {
+			continue;
+		}
+
+		if (num >= max_ids) {
+			PRINT_STRING("LOADER: MADT lists too many processors\n");
+			return -1;
+		}
+
+		apic_ids[num++] = apic_id;
+	}
+
+	*count = num;
+	return 0;
+}
+
+/* End of file */
@@ -41,17 +41,32 @@ void load_primary_guest_kernel(xmon_desc_t *td)
 {
 	multiboot_info_t *mbi;
 	mon_guest_cpu_startup_state_t *s;
+	boot_info_t *boot_info;
+
+	boot_info = boot_info_validate(BOOT_INFO_BASE(td));
+	boot_info_record(boot_info, BOOT_EVENT_LINUX_LOADER_ENTRY);
 
 	s = (mon_guest_cpu_startup_state_t *)GUEST1_BASE(td);
 	mbi = (multiboot_info_t *)((uint32_t)(s->gp.reg[IA32_REG_RBX]));
 
 	print_string("LOADER: prepare to load primary os kernel!\n");
 
-	/* hide xmon/startap runtime memories*/
-	hide_runtime_memory(mbi, STARTAP_BASE(td), STARTAP_SIZE + XMON_SIZE(td));
+	/* with asynchronous AP launch APs may still be on their way to xmon
+	 * entry with arguments in loader memory, which Linux gets back */
+	if (NULL != boot_info) {
+		while (boot_info->aps_launched < boot_info->aps_released) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
+	}
+
+	/* hide xmon/boot info/startap runtime memories*/
+	hide_runtime_memory(mbi, STARTAP_BASE(td),
+		STARTAP_SIZE + BOOT_INFO_SIZE + XMON_SIZE(td));
 
 	/* by default, load guest linux kernel for primary guest */
-	launch_linux_kernel(mbi);
+	launch_linux_kernel(mbi, boot_info);
 
 	while (1) {
 	}
@@ -17,38 +17,116 @@
 #include <xmon_loader.h>
 #include <memory.h>
 #include <screen.h>
+#include <common.h>
+
+/*
+ * Loader heap layout:
+ *
+ *   heap_base         heap_current   heap_pages_bottom          heap_tops
+ *   | small objects -->   |  free    |   <-- page allocations   |
+ *
+ * Small objects grow up from the bottom and pages grow down from the top, so
+ * mixing the two never wastes alignment padding. Only the most recent small
+ * object can be given back; the loader heap lives only until Linux starts.
+ *
+ * Runtime pages are taken down from the top of a separate area, given by
+ * initialize_runtime_memory(), which stays hidden from Linux. Whatever APs
+ * parked in startap still use once Linux owns the loader heap goes there.
+ */
+
+#define PAGE_SIZE (1024 * 4)
+#define SMALL_ALIGN 8
+#define ALLOC_MAGIC 0x434f4c41  /* "ALOC" */
+
+/* placed in front of each small object */
+typedef struct {
+	uint32_t size;          /* including this header */
+	uint32_t magic;
+} alloc_header_t;
 
 uint32_t heap_base;
 uint32_t heap_current;
 uint32_t heap_tops;
 
+static uint32_t heap_pages_bottom;
+static uint32_t heap_high_water;
+
+static uint32_t runtime_base;
+static uint32_t runtime_bottom;
+
 void_t zero_mem(void_t *address, uint32_t size)
 {
-	uint8_t *source;
+	mon_memset(address, 0, size);
+}
+
+static void update_high_water(void)
+{
+	uint32_t used = (heap_current - heap_base) +
+			(heap_tops - heap_pages_bottom);
 
-	source = (uint8_t *)address;
-	while (size--)
-		*source++ = 0;
+	if (used > heap_high_water) {
+		heap_high_water = used;
+	}
+}
+
+static void report_heap_exhausted(uint32_t size_request)
+{
+	PRINT_STRING("Allocation request exceeds heap's size\r\n");
+	PRINT_STRING_AND_VALUE("Heap current = 0x", heap_current);
+	PRINT_STRING_AND_VALUE("Heap pages bottom = 0x", heap_pages_bottom);
+	PRINT_STRING_AND_VALUE("Requested size = 0x", size_request);
 }
 
 /*
- * allocate_memory(): Simple memory allocation routine */
+ * allocate_memory(): Small object allocation, memory is zeroed */
 void_t *allocate_memory(uint32_t size_request)
 {
-	uint32_t address;
+	alloc_header_t *hdr;
+	uint32_t size;
+
+	if (size_request > heap_tops - heap_base) {
+		report_heap_exhausted(size_request);
+		return NULL;
+	}
 
-	if (heap_current + size_request > heap_tops) {
-		PRINT_STRING("Allocation request exceeds heap's size\r\n");
-		PRINT_STRING_AND_VALUE("Heap current = 0x", heap_current);
-		PRINT_STRING_AND_VALUE("Requested size = 0x", size_request);
-		PRINT_STRING_AND_VALUE("Heap tops = 0x", heap_tops);
+	size = ALIGN_FORWARD(size_request + sizeof(alloc_header_t), SMALL_ALIGN);
 
+	if (size > heap_pages_bottom - heap_current) {
+		report_heap_exhausted(size_request);
 		return NULL;
 	}
-	address = heap_current;
-	heap_current += size_request;
-	zero_mem((void_t *)address, size_request);
-	return (void_t *)address;
+
+	hdr = (alloc_header_t *)heap_current;
+	heap_current += size;
+	update_high_water();
+
+	hdr->size = size;
+	hdr->magic = ALLOC_MAGIC;
+	zero_mem(hdr + 1, size - sizeof(alloc_header_t));
+	return (void_t *)(hdr + 1);
+}
+
+/* free_memory(): Release memory returned by allocate_memory(). Only the most
+ * recent allocation goes back to the heap, an older one stays in use. */
+void_t free_memory(void_t *address)
+{
+	alloc_header_t *hdr = (alloc_header_t *)address - 1;
+
+	if (address == NULL) {
+		return;
+	}
+
+	if (((uint32_t)hdr < heap_base) || ((uint32_t)address >= heap_current) ||
+	    (hdr->magic != ALLOC_MAGIC)) {
+		PRINT_STRING_AND_VALUE("Invalid free, address = 0x", address);
+		return;
+	}
+
+	hdr->magic = 0;
+
+	if ((uint32_t)hdr + hdr->size == heap_current) {
+		heap_current = (uint32_t)hdr;
+	}
 }
 
 /* print_e820_bios_memory_map(): Routine to print the E820 BIOS memory map */
@@ -60,21 +138,44 @@ void_t initialize_memory_manager(uint64_t *heap_base_address, uint64_t *heap_byt
 {
 	heap_current = heap_base = *(uint32_t *)heap_base_address;
 	heap_tops = heap_base + *(uint32_t *)heap_bytes;
+	heap_pages_bottom = heap_tops & ~(PAGE_SIZE - 1);
+
+	if (heap_pages_bottom < heap_current) {
+		heap_pages_bottom = heap_current;
+	}
+
+	heap_high_water = 0;
 }
 
-void_t copy_mem(void_t *dest, void_t *source, uint32_t size)
+void_t print_heap_usage(void_t)
 {
-	uint8_t *d = (uint8_t *)dest;
-	uint8_t *s = (uint8_t *)source;
+	PRINT_STRING_AND_VALUE("Loader heap size = 0x", heap_tops - heap_base);
+	PRINT_STRING_AND_VALUE("Loader heap high water mark = 0x",
+		heap_high_water);
+}
 
-	while (size--)
-		*d++ = *s++;
+void_t copy_mem(void_t *dest, void_t *source, uint32_t size)
+{
+	mon_memcpy(dest, source, size);
 }
 
 boolean_t compare_mem(void_t *source1, void_t *source2, uint32_t size)
 {
-	uint8_t *s1 = (uint8_t *)source1;
-	uint8_t *s2 = (uint8_t *)source2;
+	uint32_t *w1 = (uint32_t *)source1;
+	uint32_t *w2 = (uint32_t *)source2;
+	uint8_t *s1;
+	uint8_t *s2;
+
+	/* compare dwords first, the rest byte by byte */
+	for (; size >= sizeof(uint32_t); size -= sizeof(uint32_t)) {
+		if (*w1++ != *w2++) {
+			PRINT_STRING("Compare mem failed\n");
+			return FALSE;
+		}
+	}
+
+	s1 = (uint8_t *)w1;
+	s2 = (uint8_t *)w2;
 
 	while (size--) {
 		if (*s1++ != *s2++) {
@@ -85,26 +186,63 @@ boolean_t compare_mem(void_t *source1, void_t *source2, uint32_t size)
 	return TRUE;
 }
 
-#define PAGE_SIZE (1024 * 4)
+void_t initialize_runtime_memory(uint32_t base, uint32_t size)
+{
+	runtime_base = ALIGN_FORWARD(base, PAGE_SIZE);
+	runtime_bottom = (base + size) & ~(PAGE_SIZE - 1);
+
+	if (runtime_bottom < runtime_base) {
+		runtime_bottom = runtime_base;
+	}
+}
+
+/* mon_runtime_page_alloc(): Page allocation from the runtime area, memory is
+ * zeroed */
+void *CDECL mon_runtime_page_alloc(uint32_t pages)
+{
+	uint32_t size = pages * PAGE_SIZE;
+
+	if ((pages == 0) ||
+	    (pages > (runtime_bottom - runtime_base) / PAGE_SIZE)) {
+		PRINT_STRING("Allocation request exceeds runtime area's size\r\n");
+		PRINT_STRING_AND_VALUE("Runtime bottom = 0x", runtime_bottom);
+		PRINT_STRING_AND_VALUE("Requested size = 0x", size);
+		return NULL;
+	}
+
+	runtime_bottom -= size;
+	zero_mem((void *)runtime_bottom, size);
+	return (void *)runtime_bottom;
+}
+
+/* Lowest address of the runtime area in use */
+uint32_t get_runtime_memory_bottom(void_t)
+{
+	return runtime_bottom;
+}
 
+/* mon_page_alloc(): Page allocation, memory is zeroed */
 void *CDECL mon_page_alloc(uint32_t pages)
 {
-	uint32_t address;
 	uint32_t size = pages * PAGE_SIZE;
+	void *address;
 
-	address = ALIGN_FORWARD(heap_current, PAGE_SIZE);
+	if ((pages == 0) || (pages > (heap_tops - heap_base) / PAGE_SIZE)) {
+		report_heap_exhausted(size);
+		return NULL;
+	}
 
-	if (address + size > heap_tops) {
-		PRINT_STRING("Allocation request exceeds heap's size\r\n");
-		PRINT_STRING_AND_VALUE("Page aligned heap current = 0x", address);
-		PRINT_STRING_AND_VALUE("Requested size = 0x", size);
-		PRINT_STRING_AND_VALUE("Heap tops = 0x", heap_tops);
+	if (size > heap_pages_bottom - heap_current) {
+		report_heap_exhausted(size);
 		return NULL;
 	}
 
-	heap_current = address + size;
-	zero_mem((void *)address, size);
-	return (void *)address;
+	heap_pages_bottom -= size;
+	address = (void *)heap_pages_bottom;
+	update_high_water();
+
+	zero_mem(address, size);
+	return address;
 }
 
 void __cpuid(int cpu_info[4], int info_type)
@@ -122,3 +260,19 @@ void __cpuid(int cpu_info[4], int info_type)
 		: "cc"
 		);
 }
+
+void __cpuidex(int cpu_info[4], int info_type, int sub_type)
+{
+	__asm__ __volatile__ (
+		"pushl %%ebx      \n\t" /* save %ebx */
+		"cpuid            \n\t"
+		"movl %%ebx, %1   \n\t" /* save what cpuid just put in %ebx */
+		"popl %%ebx       \n\t" /* restore the old %ebx */
+		: "=a" (cpu_info[0]),
+		"=r" (cpu_info[1]),
+		"=c" (cpu_info[2]),
+		"=d" (cpu_info[3])
+		: "a" (info_type), "c" (sub_type)
+		: "cc"
+		);
+}
@@ -21,6 +21,8 @@ void_t zero_mem(void_t *address, uint32_t size);
 
 void_t *allocate_memory(uint32_t size);
 
+void_t free_memory(void_t *address);
+
 void_t print_e820_bios_memory_map(void_t);
 
 void_t initialize_memory_manager(uint64_t *heap_base_address, uint64_t *heap_bytes);
@@ -31,4 +33,12 @@ boolean_t compare_mem(void_t *source1, void_t *source2, uint32_t size);
 
 void *CDECL mon_page_alloc(uint32_t pages);
 
+void_t initialize_runtime_memory(uint32_t base, uint32_t size);
+
+void *CDECL mon_runtime_page_alloc(uint32_t pages);
+
+uint32_t get_runtime_memory_bottom(void_t);
+
+void_t print_heap_usage(void_t);
+
 #endif                          /* MEMORY_H */
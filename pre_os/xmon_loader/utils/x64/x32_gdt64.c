@@ -28,7 +28,7 @@
 #include "x32_gdt64.h"
 #include "common.h"
 
-extern void *CDECL mon_page_alloc(uint32_t pages);
+extern void *CDECL mon_runtime_page_alloc(uint32_t pages);
 extern void clear_screen();
 extern void print_string(uint8_t *string);
 extern void print_value(uint32_t value);
@@ -53,7 +53,8 @@ void x32_gdt64_setup(void)
 
 	/* allocate page for 64-bit GDT */
 	/* 1 page should be sufficient ??? */
-	p_gdt_64 = mon_page_alloc(1);
+	/* APs parked in startap load it after Linux owns the loader heap */
+	p_gdt_64 = mon_runtime_page_alloc(1);
 	XMON_LOADER_ASSERT(p_gdt_64);
 	mon_memset(p_gdt_64, 0, PAGE_4KB_SIZE);
 
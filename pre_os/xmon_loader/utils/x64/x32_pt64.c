@@ -17,7 +17,7 @@
 /*---------------------------------------------------*
  *
  * file		: x32_pt64.c
- * purpose	: Configures 4G memory space for 64-bit mode
+ * purpose	: Configures 64-bit mode memory space (4G at least)
  *			: while runnning in 32-bit mode
  *
  *----------------------------------------------------*/
@@ -28,7 +28,9 @@
 #include "x32_pt64.h"
 #include "common.h"
 
-extern void *CDECL mon_page_alloc(uint32_t pages);
+extern void *CDECL mon_runtime_page_alloc(uint32_t pages);
+void __cpuid(int cpu_info[4], int info_type);
+
 #define XMON_LOADER_ASSERT(__condition) \
 	{                              \
 		if (!(__condition)) {  \
@@ -37,87 +39,98 @@ extern void *CDECL mon_page_alloc(uint32_t pages);
 		}                      \
 	}
 
+/* page table entry bits */
+#define PT64_PRESENT            0x1
+#define PT64_RW                 0x2
+#define PT64_PS                 0x80    /* 2MB page in PD, 1GB page in PDPT */
+#define PT64_TABLE_ENTRIES      512
+
+#define PT64_PAGE_1GB_SHIFT     30
+#define CPUID_EXT_EDX_PAGE_1GB  (1 << 26)
+
+/* a single PDPT covers 512G with 1G pages, 2MB pages are used for 4G only */
+#define PT64_MAX_SIZE_1GB_PAGES ((uint64_t)PT64_TABLE_ENTRIES << \
+				 PT64_PAGE_1GB_SHIFT)
+#define PT64_MAX_SIZE_2MB_PAGES 0x100000000ULL
+
 static em64t_cr3_t cr3_for_x64 = { 0 };
 
+static boolean_t x32_pt64_1gb_pages_supported(void)
+{
+	int info[4];
+
+	__cpuid(info, 0x80000000);
+	if ((uint32_t)info[0] < 0x80000001) {
+		return FALSE;
+	}
+
+	__cpuid(info, 0x80000001);
+	return (info[3] & CPUID_EXT_EDX_PAGE_1GB) != 0;
+}
+
 /*---------------------------------------------------------*
 *  FUNCTION		: x32_pt64_setup_paging
-*  PURPOSE		: establish paging tables for x64 -bit mode, 2MB pages
-*                               : while running in 32-bit mode.
-*				: It should scope full 32-bit space, i.e. 4G
-*  ARGUMENTS	:
+*  PURPOSE		: establish identity mapped paging tables for x64 -bit
+*				: mode while running in 32-bit mode. 1GB pages are
+*				: used if supported, 2MB pages otherwise.
+*				: At least the full 32-bit space, i.e. 4G, is mapped,
+*				: memory_size above 4G is mapped with 1GB pages only.
+*  ARGUMENTS	: memory_size - size of the space to map
 *  RETURNS		: void
 *---------------------------------------------------------*/
 void x32_pt64_setup_paging(uint64_t memory_size)
 {
-	em64t_pml4_t *pml4_table;
-	em64t_pdpe_t *pdp_table;
-	em64t_pde_2mb_t *pd_table;
+	uint64_t *pml4_table;
+	uint64_t *pdp_table;
+	uint64_t *pd_table;
 
+	uint32_t pdpt_entries;
 	uint32_t pdpt_entry_id;
 	uint32_t pdt_entry_id;
 	uint32_t address = 0;
+	boolean_t page_1gb = x32_pt64_1gb_pages_supported();
 
-	if (memory_size >= 0x100000000) {
-		memory_size = 0x100000000;
+	if (memory_size < 0x100000000ULL) {
+		memory_size = 0x100000000ULL;
 	}
 
-	/*
-	 * To cover 4G-byte addrerss space the minimum set is PML4 - 1entry PDPT -
-	 * 4 entries PDT - 2048 entries */
+	if (page_1gb && (memory_size > PT64_MAX_SIZE_1GB_PAGES)) {
+		memory_size = PT64_MAX_SIZE_1GB_PAGES;
+	} else if (!page_1gb && (memory_size > PT64_MAX_SIZE_2MB_PAGES)) {
+		memory_size = PT64_MAX_SIZE_2MB_PAGES;
+	}
 
-	pml4_table = (em64t_pml4_t *)mon_page_alloc(1);
+	pdpt_entries = (uint32_t)((memory_size + (1 << PT64_PAGE_1GB_SHIFT) - 1)
+				  >> PT64_PAGE_1GB_SHIFT);
+
+	/* pages from mon_runtime_page_alloc() are zeroed. They are not in the
+	 * loader heap, APs parked in startap run on them after Linux starts */
+	pml4_table = (uint64_t *)mon_runtime_page_alloc(1);
 	XMON_LOADER_ASSERT(pml4_table);
-	mon_memset(pml4_table, 0, PAGE_4KB_SIZE);
 
-	pdp_table = (em64t_pdpe_t *)mon_page_alloc(1);
+	pdp_table = (uint64_t *)mon_runtime_page_alloc(1);
 	XMON_LOADER_ASSERT(pdp_table);
-	mon_memset(pdp_table, 0, PAGE_4KB_SIZE);
 
 	/* only one entry is enough in PML4 table */
-	pml4_table[0].lo.base_address_lo = (uint32_t)pdp_table >> 12;
-	pml4_table[0].lo.present = 1;
-	pml4_table[0].lo.rw = 1;
-	pml4_table[0].lo.us = 0;
-	pml4_table[0].lo.pwt = 0;
-	pml4_table[0].lo.pcd = 0;
-	pml4_table[0].lo.accessed = 0;
-	pml4_table[0].lo.ignored = 0;
-	pml4_table[0].lo.zeroes = 0;
-	pml4_table[0].lo.avl = 0;
-
-	/* 4 entries is enough in PDPT */
-	for (pdpt_entry_id = 0; pdpt_entry_id < 4; ++pdpt_entry_id) {
-		pdp_table[pdpt_entry_id].lo.present = 1;
-		pdp_table[pdpt_entry_id].lo.rw = 1;
-		pdp_table[pdpt_entry_id].lo.us = 0;
-		pdp_table[pdpt_entry_id].lo.pwt = 0;
-		pdp_table[pdpt_entry_id].lo.pcd = 0;
-		pdp_table[pdpt_entry_id].lo.accessed = 0;
-		pdp_table[pdpt_entry_id].lo.ignored = 0;
-		pdp_table[pdpt_entry_id].lo.zeroes = 0;
-		pdp_table[pdpt_entry_id].lo.avl = 0;
-
-		pd_table = (em64t_pde_2mb_t *)mon_page_alloc(1);
+	pml4_table[0] = (uint32_t)pdp_table | PT64_PRESENT | PT64_RW;
+
+	for (pdpt_entry_id = 0; pdpt_entry_id < pdpt_entries; ++pdpt_entry_id) {
+		if (page_1gb) {
+			pdp_table[pdpt_entry_id] =
+				((uint64_t)pdpt_entry_id << PT64_PAGE_1GB_SHIFT) |
+				PT64_PRESENT | PT64_RW | PT64_PS;
+			continue;
+		}
+
+		pd_table = (uint64_t *)mon_runtime_page_alloc(1);
 		XMON_LOADER_ASSERT(pd_table);
-		mon_memset(pd_table, 0, PAGE_4KB_SIZE);
-		pdp_table[pdpt_entry_id].lo.base_address_lo = (uint32_t)pd_table >>
-							      12;
+		pdp_table[pdpt_entry_id] = (uint32_t)pd_table | PT64_PRESENT |
+					   PT64_RW;
 
-		for (pdt_entry_id = 0; pdt_entry_id < 512;
+		for (pdt_entry_id = 0; pdt_entry_id < PT64_TABLE_ENTRIES;
 		     ++pdt_entry_id, address += PAGE_2MB_SIZE) {
-			pd_table[pdt_entry_id].lo.present = 1;
-			pd_table[pdt_entry_id].lo.rw = 1;
-			pd_table[pdt_entry_id].lo.us = 0;
-			pd_table[pdt_entry_id].lo.pwt = 0;
-			pd_table[pdt_entry_id].lo.pcd = 0;
-			pd_table[pdt_entry_id].lo.accessed = 0;
-			pd_table[pdt_entry_id].lo.dirty = 0;
-			pd_table[pdt_entry_id].lo.pse = 1;
-			pd_table[pdt_entry_id].lo.global = 0;
-			pd_table[pdt_entry_id].lo.avl = 0;
-			pd_table[pdt_entry_id].lo.pat = 0; /* ???? */
-			pd_table[pdt_entry_id].lo.zeroes = 0;
-			pd_table[pdt_entry_id].lo.base_address_lo = address >> 21;
+			pd_table[pdt_entry_id] = address | PT64_PRESENT | PT64_RW |
+						 PT64_PS;
 		}
 	}
 
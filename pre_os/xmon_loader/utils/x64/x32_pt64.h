@@ -17,7 +17,7 @@
 /*---------------------------------------------------*
  *
  * file		: x32_pt64.h
- * purpose	: Configures 4G memory space for 64-bit mode
+ * purpose	: Configures 64-bit mode memory space (4G at least)
  *			: while runnning in 32-bit mode
  *
  *
@@ -27,10 +27,12 @@
 
 /*---------------------------------------------------------*
 *  FUNCTION		: x32_pt64_setup_paging
-*  PURPOSE		: establish paging tables for x64 -bit mode, 2MB pages
-*                               : while running in 32-bit mode.
-*				: It should scope full 32-bit space, i.e. 4G
-*  ARGUMENTS	:
+*  PURPOSE		: establish identity mapped paging tables for x64 -bit
+*				: mode while running in 32-bit mode. 1GB pages are
+*				: used if supported, 2MB pages otherwise.
+*				: At least the full 32-bit space, i.e. 4G, is mapped,
+*				: memory_size above 4G is mapped with 1GB pages only.
+*  ARGUMENTS	: memory_size - size of the space to map
 *  RETURNS		: void
 *---------------------------------------------------------*/
 void x32_pt64_setup_paging(uint64_t memory_size);
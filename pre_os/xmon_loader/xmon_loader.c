@@ -27,14 +27,146 @@
 #include "x32_init64.h"
 #include "xmon_desc.h"
 #include "common.h"
+#include "boot_info.h"
+#include "xmon_loader.h"
+#include "screen.h"
+#include "multiboot1.h"
+#include "lz4.h"
 
 #define get_e820_table get_e820_table_from_multiboot
 
 void __cpuid(int cpu_info[4], int info_type);
+void __cpuidex(int cpu_info[4], int info_type, int sub_type);
 void setup_idt(void);
 int get_e820_table_from_multiboot(xmon_desc_t *td, uint64_t *e820_addr);
+boolean_t load_image_and_get_info(const void *file_mapped_into_memory,
+				  void *image_base_address,
+				  uint32_t allocated_size,
+				  uint64_t *p_entry_point_address,
+				  image_info_t *p_image_info);
+int get_ap_apic_ids_from_madt(uint32_t bsp_apic_id, uint32_t *apic_ids,
+			      uint32_t max_ids, uint32_t *count);
 extern mon_guest_startup_t *setup_primary_guest_env(xmon_desc_t *td);
 
+/*
+ * Return the plain ELF image of a package component. A compressed component
+ * is decompressed to 'scratch' first; NULL is returned if that fails.
+ */
+static void *get_uncompressed_image(void *image, uint32_t image_size,
+				    void *scratch, uint32_t scratch_size)
+{
+	if (!lz4_is_compressed(image, image_size)) {
+		return image;
+	}
+
+	if (lz4_decompress(image, image_size, scratch, scratch_size) == 0) {
+		PRINT_STRING("LOADER: failed to decompress image\n");
+		return NULL;
+	}
+
+	return scratch;
+}
+
+/*
+ * Find "name" at the start of a word in cmdline, return its value following
+ * it or NULL.
+ */
+const char *find_cmdline_param(const char *cmdline, const char *name)
+{
+	const char *p;
+	uint32_t i;
+
+	for (p = cmdline; *p != '\0'; p++) {
+		if ((p != cmdline) && (p[-1] != ' ')) {
+			continue;
+		}
+
+		for (i = 0; (name[i] != '\0') && (p[i] == name[i]); i++) {
+		}
+
+		if (name[i] == '\0') {
+			return p + i;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Lazy AP launch policy from the package cmdline:
+ *   xmon_early_aps=<n>    - xmon is launched on the BSP and <n> APs
+ *   xmon_early_aps=cores  - on one thread of each core
+ * The other APs wait in startap until xmon releases them through
+ * boot_info->ap_release. Return INIT32_FLAG_LAZY_xxx, 0 to launch all.
+ */
+static uint16_t get_ap_launch_policy(xmon_desc_t *td,
+				     uint32_t *num_of_early_aps)
+{
+	mon_guest_cpu_startup_state_t *s;
+	multiboot_info_t *mbi;
+	const char *value;
+	uint32_t num = 0;
+
+	s = (mon_guest_cpu_startup_state_t *)GUEST1_BASE(td);
+	mbi = (multiboot_info_t *)((uint32_t)(s->gp.reg[IA32_REG_RBX]));
+
+	if (!(mbi->flags & MBI_CMDLINE) || (mbi->cmdline == 0)) {
+		return 0;
+	}
+
+	value = find_cmdline_param((const char *)mbi->cmdline,
+		"xmon_early_aps=");
+	if (value == NULL) {
+		return 0;
+	}
+
+	/* the value must be a whole word, "coresX" or "4x" are rejected */
+	if ((value[0] == 'c') && (value[1] == 'o') && (value[2] == 'r') &&
+	    (value[3] == 'e') && (value[4] == 's') &&
+	    ((value[5] == '\0') || (value[5] == ' '))) {
+		return INIT32_FLAG_LAZY_SMT;
+	}
+
+	if ((*value >= '0') && (*value <= '9')) {
+		while ((*value >= '0') && (*value <= '9')) {
+			num = num * 10 + (*value - '0');
+			value++;
+		}
+
+		if ((*value == '\0') || (*value == ' ')) {
+			*num_of_early_aps = num;
+			return INIT32_FLAG_LAZY_APS;
+		}
+	}
+
+	PRINT_STRING("LOADER: bad xmon_early_aps value, launch all APs\n");
+	return 0;
+}
+
+/* End of the highest range reported by e820, page tables must cover it */
+static uint64_t get_e820_top(uint64_t e820_addr)
+{
+	int15_e820_memory_map_t *e820 =
+		(int15_e820_memory_map_t *)(uint32_t)e820_addr;
+	uint32_t count;
+	uint32_t i;
+	uint64_t top = 0;
+
+	count = e820->memory_map_size /
+		sizeof(int15_e820_memory_map_entry_ext_t);
+
+	for (i = 0; i < count; i++) {
+		uint64_t end = e820->memory_map_entry[i].basic_entry.base_address +
+			       e820->memory_map_entry[i].basic_entry.length;
+
+		if (end > top) {
+			top = end;
+		}
+	}
+
+	return top;
+}
+
 static mon_startup_struct_t
 *setup_env(xmon_desc_t *td,
 	   image_info_t *startap,
@@ -75,7 +207,6 @@ void xmon_loader(xmon_desc_t *td)
 	static init64_struct_t init64;
 	static init32_struct_t init32;
 
-	image_info_status_t image_info_status;
 	image_info_t startap_hdr;
 	image_info_t xmon_hdr;
 
@@ -88,15 +219,25 @@ void xmon_loader(xmon_desc_t *td)
 	uint32_t heap_size;
 
 	uint64_t e820_addr;
+	boot_info_t *boot_info;
 	void *p_xmon = NULL;
 	void *p_startap = NULL;
 	void *p_low_mem = (void *)0x8000; /* find 20 KB below 640 K */
+	uint32_t scratch_base;
+	uint32_t scratch_size;
+	uint32_t xmon_load_limit;
+	uint32_t runtime_base;
 
 	int info[4] = { 0, 0, 0, 0 };
 	int num_of_aps;
+	uint32_t num_of_known_aps;
+	uint32_t bsp_apic_id;
+	uint32_t max_cpuid_leaf;
 	boolean_t ok;
 	int r;
-	int i;
+
+	boot_info = boot_info_validate(BOOT_INFO_BASE(td));
+	boot_info_record(boot_info, BOOT_EVENT_XMON_LOADER_ENTRY);
 
 	/* Init loader heap, run-time space, and idt. */
 	heap_base = XMON_LOADER_HEAP_BASE(td);
@@ -109,84 +250,203 @@ void xmon_loader(xmon_desc_t *td)
 		return;
 	}
 
-	p_xmon = (void *)((uint32_t)td + td->xmon_start * 512);
-	image_info_status = get_image_info(p_xmon, XMON_SIZE(td), &xmon_hdr);
-	if ((image_info_status != IMAGE_INFO_OK) ||
-	    (xmon_hdr.machine_type != IMAGE_MACHINE_EM64T) ||
-	    (xmon_hdr.load_size == 0)) {
-		return;
-	}
+	boot_info_record(boot_info, BOOT_EVENT_E820_READY);
 
-	/* Load xmon image */
-	ok = load_image(p_xmon, (void *)XMON_BASE(td), XMON_SIZE(td), &call_xmon);
-
-	if (!ok) {
-		return;
-	}
+	/* Compressed images are expanded to the upper half of xmon memory, which
+	 * is not used before xmon sets up its heap.
+	 */
+	scratch_base = MON_PAGE_ALIGN_4K(XMON_BASE(td) + XMON_SIZE(td) / 2);
+	scratch_size = XMON_BASE(td) + XMON_SIZE(td) - scratch_base;
+	xmon_load_limit = XMON_SIZE(td);
 
 	/* Load startap image */
 	p_startap = (void *)((uint32_t)td + td->startap_start * 512);
-
-	image_info_status = get_image_info((void *)p_startap,
-		STARTAP_SIZE, &startap_hdr);
-
-	if ((image_info_status != IMAGE_INFO_OK) ||
-	    (startap_hdr.machine_type != IMAGE_MACHINE_X86) ||
-	    (startap_hdr.load_size == 0)) {
+	p_startap = get_uncompressed_image(p_startap, td->startap_count * 512,
+		(void *)scratch_base, scratch_size);
+	if (p_startap == NULL) {
 		return;
 	}
 
-	ok = load_image((void *)p_startap,
+	ok = load_image_and_get_info((void *)p_startap,
 		(void *)STARTAP_BASE(td),
-		STARTAP_SIZE, (uint64_t *)&call_startap);
+		STARTAP_SIZE, (uint64_t *)&call_startap, &startap_hdr);
 
-	if (!ok) {
+	if (!ok || (startap_hdr.machine_type != IMAGE_MACHINE_X86) ||
+	    (startap_hdr.load_size == 0)) {
 		return;
 	}
 
-	/* setup primary guest initial environment so that after xmon launch,
-	 *  the CPU control can be back to where we specified.
+	boot_info_record(boot_info, BOOT_EVENT_STARTAP_LOADED);
+
+	/* Setup init32. */
+	__cpuid(info, 0);
+	max_cpuid_leaf = info[0];
+
+	__cpuid(info, 1);
+	bsp_apic_id = (info[1] >> 24) & 0xff;
+
+	/* 8-bit APIC ID from leaf 1 is truncated in x2APIC systems, take the
+	 * full one from the extended topology leaf when it is available.
 	 */
-	setup_primary_guest_env(td);
+	if (max_cpuid_leaf >= 0xb) {
+		int topo[4];
 
-	mon_env = setup_env(td, &startap_hdr, &xmon_hdr, call_startap);
-	mon_env->physical_memory_layout_E820 = e820_addr;
+		__cpuidex(topo, 0xb, 0);
+		if (topo[1] != 0) {
+			bsp_apic_id = topo[3];
+		}
+	}
 
-	/* Setup init32. */
-	/* It only gets the max. number of logical cores, not the real number.
-	 * But it will be OK here since it only waste some memory (2 pages for
-	 * each core) and the memory will be abandoned after MON lunch and MON
-	 * will get the real number using SIPI.
+	/* MADT gives the exact list of enabled APs, so startap can stop waiting
+	 * as soon as all of them arrived.
 	 */
-	__cpuid(info, 1);
-	num_of_aps = ((info[1] >> 16) & 0xff) - 1;
+	if (get_ap_apic_ids_from_madt(bsp_apic_id,
+		    init32.i32_ap_apic_ids, MAX_CPUS, &num_of_known_aps) == 0) {
+		num_of_aps = num_of_known_aps;
+		init32.i32_num_of_known_aps = num_of_known_aps;
+	} else {
+		/* It only gets the max. number of logical cores, not the real
+		 * number. But it will be OK here since it only waste some memory
+		 * (2 pages for each core) and the memory will be abandoned after
+		 * MON lunch and MON will get the real number using SIPI.
+		 */
+		num_of_aps = ((info[1] >> 16) & 0xff) - 1;
+		init32.i32_num_of_known_aps = 0;
+	}
 
 	if (num_of_aps < 0) {
 		num_of_aps = 0;
 	}
 
+	/* init32 has room for MAX_CPUS AP stacks only */
+	if (num_of_aps > MAX_CPUS) {
+		num_of_aps = MAX_CPUS;
+	}
+
 	init32.i32_low_memory_page = (uint32_t)p_low_mem;
 	init32.i32_num_of_aps = num_of_aps;
 
-	for (i = 0; i < num_of_aps; i++) {
-		uint8_t *buf = mon_page_alloc(2);
+	/* Kick APs now, they check in and wait in startap while xmon is being
+	 * loaded and paging is set up. The second call only releases them.
+	 */
+	call_startap_entry = (startap_image_entry_point_t)((uint32_t)call_startap);
 
-		if (buf == NULL) {
-			return;
-		}
+#ifdef AP_LONG_MODE_STARTUP
+	/* APs go from real mode straight to xmon entry in the final call
+	 * instead, they need the page tables set up before INIT-SIPI.
+	 */
+	init32.i32_flags = INIT32_FLAG_AP_LONG_MODE;
+#else
+	if (num_of_aps != 0) {
+		init64.i64_boot_info = (uint32_t)boot_info;
+		init32.i32_flags = INIT32_FLAG_KICK_APS_ONLY;
+		call_startap_entry(&init32, &init64, NULL, 0);
+		init32.i32_flags = INIT32_FLAG_APS_ALREADY_STARTED;
+
+		/* waiting APs help with large copies and clears meanwhile */
+		mon_set_bulk_mem_op((mon_bulk_mem_op_t)init32.i32_bulk_mem_op);
+	}
+#endif
+
+	/* Load xmon image */
+	p_xmon = (void *)((uint32_t)td + td->xmon_start * 512);
+	if (lz4_is_compressed(p_xmon, td->xmon_count * 512)) {
+		/* must not overwrite its own source */
+		xmon_load_limit = scratch_base - XMON_BASE(td);
+	}
+
+	p_xmon = get_uncompressed_image(p_xmon, td->xmon_count * 512,
+		(void *)scratch_base, scratch_size);
+	if (p_xmon == NULL) {
+		return;
+	}
+
+	ok = load_image_and_get_info(p_xmon, (void *)XMON_BASE(td), xmon_load_limit,
+		&call_xmon, &xmon_hdr);
 
-		init32.i32_esp[i] = (uint32_t)&buf[PAGE_4KB_SIZE * 2];
+	if (!ok || (xmon_hdr.machine_type != IMAGE_MACHINE_EM64T) ||
+	    (xmon_hdr.load_size == 0)) {
+		return;
+	}
+
+	boot_info_record(boot_info, BOOT_EVENT_XMON_LOADED);
+
+	/* The scratch half of xmon memory is free now. Page tables, GDT and AP
+	 * stacks are taken from its top, which is hidden from Linux with xmon
+	 * memory but kept out of the memory xmon is told about, so APs parked
+	 * in startap can use them after the loader heap is gone.
+	 */
+	runtime_base = XMON_BASE(td) + MON_PAGE_ALIGN_4K(xmon_hdr.load_size);
+	if (runtime_base < scratch_base) {
+		runtime_base = scratch_base;
 	}
+	initialize_runtime_memory(runtime_base,
+		XMON_BASE(td) + XMON_SIZE(td) - runtime_base);
+
+	/* setup primary guest initial environment so that after xmon launch,
+	 *  the CPU control can be back to where we specified.
+	 */
+	setup_primary_guest_env(td);
+
+	mon_env = setup_env(td, &startap_hdr, &xmon_hdr, call_startap);
+	mon_env->physical_memory_layout_E820 = e820_addr;
 
 	/* Setup init64. */
 	x32_gdt64_setup();
 	x32_gdt64_get_gdtr(&init64.i64_gdtr);
-	x32_pt64_setup_paging(((uint64_t)1024 * 4) * 0x100000);
+	x32_pt64_setup_paging(get_e820_top(e820_addr));
 	init64.i64_cr3 = x32_pt64_get_cr3();
 	init64.i64_cs = x32_gdt64_get_cs();
 	init64.i64_efer = 0;
+	init64.i64_boot_info = (uint32_t)boot_info;
+
+	/* AP stacks are carved by startap from a single pool once it knows how
+	 * many APs really showed up. Ask for the largest stacks, and halve the
+	 * request down to the smallest ones if the runtime area is short.
+	 */
+	if (num_of_aps != 0) {
+		uint32_t min_pages = (num_of_aps * AP_STACK_SIZE_MIN +
+				      PAGE_4KB_SIZE - 1) / PAGE_4KB_SIZE;
+		uint32_t pool_pages = (num_of_aps * AP_STACK_SIZE_MAX +
+				       PAGE_4KB_SIZE - 1) / PAGE_4KB_SIZE;
+		void *pool = mon_runtime_page_alloc(pool_pages);
+
+		while ((pool == NULL) && (pool_pages > min_pages)) {
+			pool_pages /= 2;
+			if (pool_pages < min_pages) {
+				pool_pages = min_pages;
+			}
+			pool = mon_runtime_page_alloc(pool_pages);
+		}
+
+		if (pool == NULL) {
+			return;
+		}
+
+		init32.i32_ap_stack_base = (uint32_t)pool;
+		init32.i32_ap_stack_size = pool_pages * PAGE_4KB_SIZE;
+	}
+
+	/* xmon owns its memory up to the runtime area */
+	mon_env->mon_memory_layout[mon_image].total_size =
+		get_runtime_memory_bottom() - XMON_BASE(td);
+
+	boot_info_record(boot_info, BOOT_EVENT_PAGE_TABLES_READY);
+
+	/* APs leave the waiting loop now */
+	mon_set_bulk_mem_op(NULL);
+
+#ifdef ASYNC_AP_LAUNCH
+	/* BSP enters xmon without waiting for APs, xmon waits for
+	 * boot_info->aps_launched where it needs them, and before it launches
+	 * the primary guest
+	 */
+	init32.i32_flags |= INIT32_FLAG_ASYNC_AP_LAUNCH;
+#endif
+
+	init32.i32_flags |= get_ap_launch_policy(td,
+		&init32.i32_num_of_early_aps);
 
-	call_startap_entry = (startap_image_entry_point_t)((uint32_t)call_startap);
 	call_startap_entry((num_of_aps != 0) ? &init32 : 0,
 		&init64, mon_env, (uint32_t)call_xmon);
 
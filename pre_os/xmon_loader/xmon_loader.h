@@ -30,5 +30,6 @@
 #endif
 
 void setup_idt(void);
+const char *find_cmdline_param(const char *cmdline, const char *name);
 
 #endif    /* XMON_LOADER_H */
@@ -24,6 +24,7 @@
 #include "em64t_defs.h"
 #include "ap_procs_init.h"
 #include "gdt.h"
+#include "boot_info.h"
 
 /*************************************************************************
  * AP startup algorithm
@@ -32,33 +33,74 @@
  * 1. Copy ap_start_up_code + GDT to low memory page
  * 2. Clear APs counter
  * 3. Send SIPI to all processors excluding self
- * 4. Wait timeout
+ * 4. Wait until all expected APs arrived or timeout
  * APs on SIPI receive:
  * 1. Switch to protected mode
- * 2. lock inc APs counter + remember my AP number
- * 3. Loop on wait_lock1 until it changes zero
+ * 2. lock xadd arrival counter to take a slot + store my local APIC ID
+ *    (read from x2APIC MSR when in x2APIC mode) in the slot's mailbox
+ * 3. Loop on wait_lock1 until it changes zero, sleeping in MWAIT on the
+ *    bootstrap state cache line if MONITOR/MWAIT is supported
  * -------- Stage 2 ----------
- * BSP after timeout:
- * 5. Read number of APs and allocate memory for stacks
+ * BSP after all APs arrived or timeout:
+ * 5. Assign AP ordered IDs to arrival slots in order of local APIC IDs
  * 6. Save GDT and IDT in global array
- * 7. Clear ready_counter count
- * 8. Set wait_lock1 to 1
- * 9. Loop on ready_counter until it will be equal to number of APs
+ * 7. Set wait_lock1 to 1
+ * 8. Wait for the ready flag in the mailbox of every AP with ordered ID
  * APs on wait_1_lock set
- * 4. Set stack in a right way
+ * 4. Park if no AP ordered ID was assigned, otherwise set stack
  * 5. Set right GDT and IDT
  * 6. Enter "C" code
- * 7. Increment ready_counter
+ * 7. Set ready flag in my mailbox
  * 8. Loop on wait_lock2 until it changes from zero
  * -------- Stage 3 ----------
- * BSP after ready_counter becomes == APs number
- * 10. Return to user
+ * BSP after ready flags of all APs are set
+ * 9. Return to user
+ * With INIT32_FLAG_AP_LONG_MODE APs run ap_start_up_code64 instead: they go
+ * from real mode straight to long mode, take the steps 2-3 there and on the
+ * continuation signal call the 64-bit entry given to ap_procs_run_long_mode()
+ * on their stacks, without stage 2 in protected mode.
+ * Once stage 1 is entered APs run startap code only, on stacks, GDT and page
+ * tables which the loader took outside of its heap, so the ones still
+ * waiting are safe when Linux reuses the low memory page and loader memory.
+ * The loader may run steps 1-3 early (INIT32_FLAG_KICK_APS_ONLY) and let
+ * APs check in while it is loading xmon. Meanwhile APs waiting in step 3 run
+ * chunks of large memory copy/set jobs for it (ap_procs_bulk_mem_op).
  * PROBLEM:
  * NMI may crash the system in it comes before AP stack init done
  ***************************************************************************/
 
 #define IA32_DEBUG_IO_PORT   0x80
+#define PIT_CH2_DATA_PORT    0x42
+#define PIT_COMMAND_PORT     0x43
+#define PIT_CH2_GATE_PORT    0x61       /* NMI status and control */
+#define PIT_CH2_GATE         0x01
+#define PIT_CH2_SPEAKER      0x02
+#define PIT_CH2_OUT          0x20
+#define PIT_CH2_MODE0_BINARY 0xb0       /* channel 2, lo/hi byte, mode 0 */
+#define PIT_FREQUENCY_HZ     1193182
+#define PIT_CALIBRATION_MSEC 10
+#define PIT_CALIBRATION_MIN_POLLS 50
+#define PIT_CALIBRATION_MAX_POLLS 1000000
+#define IA32_MSR_X2APIC_ICR  0x830
+#define IA32_MSR_X2APIC_APICID 0x802
+#define LOCAL_APIC_ID_OFFSET 0x20
+#define APIC_BASE_X2APIC_ENABLED 0x400  /* IA32_APIC_BASE.EXTD */
+#define AP_APIC_ID_INVALID   0xFFFFFFFF
+#define CACHE_LINE_SIZE      64
+#define CPUID_1_ECX_MONITOR  (1 << 3)
 #define INITIAL_WAIT_FOR_APS_TIMEOUT_IN_MILIS 150000
+#define INIT_TO_SIPI_DELAY_IN_MICROS          10000
+#define SIPI_TO_SIPI_TIMEOUT_IN_MICROS        200000
+#define LEADER_TIMEOUT_IN_MICROS              (INIT_TO_SIPI_DELAY_IN_MICROS + \
+					       2 * SIPI_TO_SIPI_TIMEOUT_IN_MICROS)
+
+/* Uncomment the following line to always use the fixed INIT-SIPI-SIPI
+ * schedule, even when the number of APs is known in advance */
+/* #define FIXED_INIT_SIPI_SCHEDULE */
+
+/* Uncomment the following line to wake up all APs from BSP, even if they
+ * are known in advance and spread over several packages */
+/* #define FLAT_AP_WAKEUP */
 
 /*
  * If see errors when compiling, need to check
@@ -83,6 +125,47 @@ inline uint64_t __rdtsc(void)
 
 #define startap_rdtsc() __rdtsc()
 static uint32_t startap_tsc_ticks_per_msec;
+static boot_tsc_source_t startap_tsc_source;
+
+static void startap_cpuidex(uint32_t leaf, uint32_t subleaf,
+			    uint32_t info[4])
+{
+	__asm__ __volatile__ (
+		"pushl %%ebx      \n\t"
+		"cpuid            \n\t"
+		"movl %%ebx, %1   \n\t"
+		"popl %%ebx       \n\t"
+		: "=a" (info[0]), "=r" (info[1]), "=c" (info[2]), "=d" (info[3])
+		: "a" (leaf), "c" (subleaf)
+		: "cc"
+		);
+}
+
+static void startap_cpuid(uint32_t leaf, uint32_t info[4])
+{
+	startap_cpuidex(leaf, 0, info);
+}
+
+/*---------------------------------------------------------------------------
+ * 64 by 32 bit division without libgcc, the quotient must fit in 32 bits.
+ * Returns 0xFFFFFFFF if it does not.
+ *---------------------------------------------------------------------------*/
+static uint32_t div_u64_u32(uint64_t dividend, uint32_t divisor)
+{
+	uint32_t quotient;
+	uint32_t remainder;
+
+	if ((uint32_t)(dividend >> 32) >= divisor) {
+		return 0xFFFFFFFF;
+	}
+
+	__asm__ ("divl %4"
+		 : "=a" (quotient), "=d" (remainder)
+		 : "a" ((uint32_t)dividend), "d" ((uint32_t)(dividend >> 32)),
+		 "rm" (divisor));
+
+	return quotient;
+}
 
 /*-------------------- internal types ---------------------------------------*/
 typedef enum {
@@ -91,25 +174,189 @@ typedef enum {
 } mp_bootstrap_state_t;
 
 /*------------------- global vars for communication with APs ----------------*/
-volatile mp_bootstrap_state_t mp_bootstrap_state;
+/* APs waiting in stage 1 MONITOR this cache line. It holds the state and the
+ * bulk memory job only, so that other stores do not wake them up for nothing.
+ * Layout is known to wakeup_init64.S, see the checks in
+ * ap_intialize_environment() */
+typedef struct {
+	mp_bootstrap_state_t state;
+	/* bulk memory job, see ap_procs_bulk_mem_op() */
+	uint32_t job_op;                /* AP_BULK_OP_xxx */
+	uint32_t job_dst;
+	uint32_t job_src;               /* source address, or fill byte */
+	uint32_t job_size;
+	uint32_t job_chunk_size;
+	uint32_t job_chunks;            /* 0 - no job, read after job_claim */
+	uint32_t job_claim;             /* generation:16, next chunk:16,
+					 * lock cmpxchg */
+	uint32_t job_done_chunks;       /* lock inc */
+	uint8_t pad[CACHE_LINE_SIZE - 9 * sizeof(uint32_t)];
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) mp_bootstrap_line_t;
+
+#define MP_LINE_JOB_OP_OFFSET          4
+#define MP_LINE_JOB_DST_OFFSET         8
+#define MP_LINE_JOB_SRC_OFFSET         12
+#define MP_LINE_JOB_SIZE_OFFSET        16
+#define MP_LINE_JOB_CHUNK_SIZE_OFFSET  20
+#define MP_LINE_JOB_CHUNKS_OFFSET      24
+#define MP_LINE_JOB_CLAIM_OFFSET       28
+#define MP_LINE_JOB_DONE_CHUNKS_OFFSET 32
+
+#define AP_BULK_OP_COPY     1
+#define AP_BULK_OP_SET      2
+#define AP_BULK_CHUNK_SIZE  0x10000
+#define AP_BULK_CHUNK_MASK  0xFFFF      /* chunk part of job_claim */
+#define AP_BULK_GENERATION  0x10000     /* generation part of job_claim */
+
+volatile mp_bootstrap_line_t mp_bootstrap_state;
+
+/* non-zero if APs wait with MONITOR/MWAIT instead of spinning */
+uint32_t g_ap_wait_mwait;
 
 init32_struct_t *gp_init32_data;
 
+/* AP stack tops by ordered ID - 1, copied from i32_esp. APs take them from
+ * here, init32 of the loader is gone once Linux runs */
+uint32_t g_ap_esp[MON_MAX_CPU_SUPPORTED];
+
 /* stage 1 */
 uint32_t g_aps_counter = 0;
 
+/* local APIC IDs of APs which are expected to arrive, startup stops waiting
+ * as soon as all of them did */
+static const uint32_t *gp_known_ap_apic_ids;
+static uint32_t g_num_of_known_aps;
+
+/* APs enumerated at the first boot, indexed by ordered ID - 1. startap
+ * stays in its reserved image area, so on S3 resume only these APs are
+ * woken up, the wakeup completes as soon as they are back, and they get
+ * the same ordered IDs and lazy launch park indexes as at the first boot */
+static uint32_t g_boot_ap_apic_ids[MON_MAX_CPU_SUPPORTED];
+static uint32_t g_boot_ap_deferred[MON_MAX_CPU_SUPPORTED];
+static uint32_t g_num_of_boot_aps;
+static boolean_t g_boot_aps_saved;
+static volatile uint32_t *gp_boot_ap_release;
+
+/* TRUE while startap is re-entered by xmon on S3 resume */
+static boolean_t g_s3_resume;
+
+/* Two level wakeup: BSP wakes one leader per package and APs of its own
+ * package, every leader wakes its siblings and waits for them on the
+ * package line. APs find their package by APIC ID in stage 1, see
+ * wakeup_init64.S. Layout is checked in ap_intialize_environment() */
+#define AP_MAX_PACKAGES       8
+#define AP_LEADER_STACK_SIZE  0x200
+
+/* SIPI rounds of a wakeup (the first and the second SIPI) */
+#define AP_SIPI_ROUNDS 2
+
+typedef struct {
+	uint32_t package_id;
+	volatile uint32_t arrived;      /* APs of the package which checked in */
+	uint32_t leader_apic_id;        /* BSP for the package of BSP */
+	uint32_t leader_stack;          /* top of the leader stack */
+	uint32_t first_sibling;         /* in g_package_ap_apic_ids */
+	uint32_t sibling_count;         /* not including the leader */
+	volatile uint32_t done;         /* leader is done with its siblings */
+	volatile uint32_t claimed;      /* siblings are woken by leader or BSP */
+	uint32_t sipi_rounds;
+	uint64_t sipi_tsc[AP_SIPI_ROUNDS]; /* SIPI rounds sent to siblings */
+	uint8_t pad[CACHE_LINE_SIZE - 9 * sizeof(uint32_t) -
+		    AP_SIPI_ROUNDS * sizeof(uint64_t)];
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) ap_package_t;
+
+#define AP_PACKAGE_ID_OFFSET             0
+#define AP_PACKAGE_ARRIVED_OFFSET        4
+#define AP_PACKAGE_LEADER_APIC_ID_OFFSET 8
+#define AP_PACKAGE_LEADER_STACK_OFFSET   12
+
+ap_package_t g_ap_packages[AP_MAX_PACKAGES];
+uint32_t g_ap_num_packages;             /* 0 - single level wakeup */
+uint32_t g_ap_package_shift;            /* package ID = APIC ID >> shift */
+static uint32_t g_package_ap_apic_ids[MON_MAX_CPU_SUPPORTED];
+static uint32_t g_bsp_target_apic_ids[MON_MAX_CPU_SUPPORTED];
+static uint32_t g_num_of_bsp_targets;
+static uint32_t g_ap_sipi_vector;
+static uint8_t g_ap_leader_stacks[AP_MAX_PACKAGES][AP_LEADER_STACK_SIZE]
+__attribute__ ((aligned(16)));
+
+/* TSC of the SIPI rounds (the first and the second SIPI) */
+static uint64_t g_sipi_tsc[AP_SIPI_ROUNDS];
+static uint32_t g_sipi_rounds;
+
+/* Per-AP mailbox, one cache line per arrival slot. Each AP writes to its
+ * own mailbox only, so check-in does not bounce shared lines between cores.
+ * Layout is known to wakeup_init64.S, see the checks in
+ * ap_intialize_environment() */
+typedef struct {
+	volatile uint32_t apic_id;      /* AP: local APIC ID, written on arrival */
+	volatile uint32_t ordered_id;   /* BSP: AP ordered ID [1..Max], 0 - park */
+	volatile uint32_t ready;        /* AP: entered "C" code of stage 2 */
+	volatile uint32_t deferred;     /* BSP: park index of a lazy AP, 0 - go */
+	uint64_t arrival_tsc;           /* AP: TSC when it took the slot */
+	uint64_t stage2_tsc;            /* AP: TSC when it left stage 1 */
+	uint64_t launch_tsc;            /* AP: TSC when it left for 64-bit entry */
+	int32_t tsc_offset;             /* BSP: AP TSC - BSP TSC, see tsc sync */
+	uint32_t tsc_rtt;               /* BSP: best round trip, 0 - not measured */
+	uint32_t tsc_skewed;            /* BSP: AP TSC out of round trip window */
+	uint8_t pad[CACHE_LINE_SIZE - 7 * sizeof(uint32_t) -
+		    3 * sizeof(uint64_t)];
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) ap_mailbox_t;
+
+#define AP_MAILBOX_APIC_ID_OFFSET     0
+#define AP_MAILBOX_ORDERED_ID_OFFSET  4
+#define AP_MAILBOX_READY_OFFSET       8
+#define AP_MAILBOX_DEFERRED_OFFSET    12
+#define AP_MAILBOX_ARRIVAL_TSC_OFFSET 16
+#define AP_MAILBOX_STAGE2_TSC_OFFSET  24
+#define AP_MAILBOX_LAUNCH_TSC_OFFSET  32
+
+/* APs take arrival slots in order of their arrival */
+volatile uint32_t g_ap_arrival_counter;
+ap_mailbox_t ap_mailboxes[MON_MAX_CPU_SUPPORTED];
+const uint32_t g_ap_arrival_slots = MON_MAX_CPU_SUPPORTED;
+
+/* BSP/AP TSC ping-pong before the launch. BSP takes APs one by one, the
+ * AP in turn answers each odd ping with its TSC */
+#define TSC_SYNC_ROUNDS 8
+
+typedef struct {
+	volatile uint32_t slot;         /* BSP: arrival slot + 1 of AP in turn */
+	volatile uint32_t seq;          /* BSP: odd - ping, AP: even - pong */
+	volatile uint64_t ap_tsc;       /* AP: TSC read between ping and pong */
+	uint8_t pad[CACHE_LINE_SIZE - 2 * sizeof(uint32_t) - sizeof(uint64_t)];
+} __attribute__ ((aligned(CACHE_LINE_SIZE))) tsc_sync_line_t;
+
+static tsc_sync_line_t g_tsc_sync;
+static boolean_t g_tsc_sync_enabled;
+
 /* stage 2 */
 
 uint8_t gp_GDT[6] = { 0 };              /* xx:xxxx */
 uint8_t gp_IDT[6] = { 0 };              /* xx:xxxx */
 
-static volatile uint32_t g_ready_counter;
-
 static func_continue_ap_t g_user_func;
 static void *g_any_data_for_user_func;
 
-/* 1 in i position means CPU[i] exists */
-uint8_t ap_presence_array[MON_MAX_CPU_SUPPORTED] = { 0 };
+/* APs count themselves here when they leave for the user function, see
+ * ap_procs_set_launch_counter(). ap_procs_run() does not wait for them if
+ * the launch is asynchronous */
+volatile uint32_t *gp_ap_launch_counter;
+static boolean_t g_ap_launch_async;
+
+/* lazy AP launch, deferred APs wait for the release word written by xmon */
+volatile uint32_t *gp_ap_release;
+static uint32_t g_num_of_deferred_aps;
+
+/* direct long mode startup (ap_start_up_code64), init64 is given by
+ * ap_procs_enable_long_mode() */
+static const init64_struct_t *gp_ap_init64;
+static boolean_t g_ap_long_mode;
+uint64_t g_ap_long_mode_entry;
+uint64_t g_ap_long_mode_args[3];
+
+/* TRUE if local APIC works in x2APIC mode */
+static boolean_t g_x2apic_mode;
 
 /* Low memory page layout */
 /* ap_start_up_code */
@@ -171,16 +418,38 @@ const uint8_t ap_start_up_code[] = {
 						 & ~7)
 #define GDT_OFFSET_IN_PAGE                      (GDTR_OFFSET_IN_PAGE + 8)
 
-/*----------------- forward decls -------------------------------------------*/
-void CDECL ap_continue_wakeup_code_C(uint32_t local_apic_id);
+/* patched part of ap_start_up_code64, see wakeup_init64.S */
+typedef struct {
+	uint16_t gdt_limit;             /* 00: lgdt operand */
+	uint32_t gdt_base;
+	uint16_t pad0;
+	uint32_t code64;                /* 08: far jump to ap_start_up_code64_long */
+	uint16_t cs;                    /* 12: 64-bit code segment selector */
+	uint16_t pad1;
+	uint32_t cr3;                   /* 16 */
+	uint32_t efer_low;              /* 20 */
+	uint32_t efer_high;             /* 24 */
+} __attribute__ ((packed)) ap_start_up_data64_t;
 
-static uint8_t bsp_enumerate_aps(void);
+/*----------------- forward decls -------------------------------------------*/
+void CDECL ap_continue_wakeup_code_C(uint32_t local_apic_id,
+				     ap_mailbox_t *mailbox);
+void startap_calibrate_tsc_ticks_per_msec(void);
+
+static uint32_t bsp_enumerate_aps(void);
+static uint32_t defer_lazy_aps(const init32_struct_t *p_init32_data);
+static uint32_t get_package_id_shift(void);
+void CDECL ap_leader_wake_package(uint32_t package_index);
 static void ap_intialize_environment(void);
 static void mp_set_bootstrap_state(mp_bootstrap_state_t new_state);
 
 /*-------------- internal functions -----------------------------------------*/
 
 extern void ap_continue_wakeup_code(void);
+extern const uint8_t ap_start_up_code64[];
+extern const uint8_t ap_start_up_code64_long[];
+extern const uint8_t ap_start_up_code64_data[];
+extern const uint8_t ap_start_up_code64_end[];
 
 /* Setup AP low memory startup code */
 static
@@ -266,6 +535,45 @@ void setup_low_memory_ap_code(uint32_t temp_low_memory_4K)
 	new_gdtr_32->limit = gdtr_32.limit;
 }
 
+/* Setup AP low memory startup code which goes straight to long mode.
+ * Return FALSE if it does not fit into the low memory page */
+static
+boolean_t setup_low_memory_ap_code64(uint32_t temp_low_memory_4K)
+{
+	uint8_t *code_to_patch = (uint8_t *)temp_low_memory_4K;
+	uint32_t code_size = (uint32_t)ap_start_up_code64_end -
+			     (uint32_t)ap_start_up_code64;
+	ap_start_up_data64_t *data;
+
+	COMPILE_TIME_ASSERT(sizeof(ap_start_up_data64_t) == 28);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_start_up_data64_t, code64) == 8);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_start_up_data64_t, cr3) == 16);
+
+	if (code_size > AP_STARTUP_CODE_SIZE) {
+		return FALSE;
+	}
+
+	mon_memcpy(code_to_patch, (const void *)ap_start_up_code64, code_size);
+
+	data = (ap_start_up_data64_t *)(code_to_patch +
+					((uint32_t)ap_start_up_code64_data -
+					 (uint32_t)ap_start_up_code64));
+
+	/* GDT and page tables of init64 are below 4G, so real mode code loads
+	 * them with 32-bit operands */
+	data->gdt_limit = gp_ap_init64->i64_gdtr.limit;
+	data->gdt_base = gp_ap_init64->i64_gdtr.base;
+	/* the long mode part runs in place, APs must not wait in the low
+	 * memory page, which Linux reuses */
+	data->code64 = (uint32_t)ap_start_up_code64_long;
+	data->cs = gp_ap_init64->i64_cs;
+	data->cr3 = gp_ap_init64->i64_cr3;
+	data->efer_low = (uint32_t)gp_ap_init64->i64_efer;
+	data->efer_high = (uint32_t)(gp_ap_init64->i64_efer >> 32);
+
+	return TRUE;
+}
+
 static
 uint64_t CDECL read_msr(uint32_t msr_index)
 {
@@ -281,15 +589,98 @@ uint64_t CDECL read_msr(uint32_t msr_index)
 	return ret;
 }
 
+static
+void CDECL write_msr(uint32_t msr_index, uint64_t value)
+{
+	__asm__ __volatile__ (
+		"wrmsr"
+		: : "c" (msr_index), "A" (value)
+		);
+}
+
 /* Initial AP setup in protected mode - should never return */
 /* End of Stage 2 */
-void CDECL ap_continue_wakeup_code_C(uint32_t local_apic_id)
+/* Deferred AP waits until xmon releases it, see boot_info_t::ap_release */
+static void ap_wait_for_release(uint32_t park_index)
+{
+	while (*gp_ap_release < park_index) {
+		if (!g_ap_wait_mwait) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+			continue;
+		}
+
+		__asm__ __volatile__ (
+			"monitor"
+			: : "a" (gp_ap_release), "c" (0), "d" (0)
+			);
+		/* released before the monitor was armed? */
+		if (*gp_ap_release >= park_index) {
+			break;
+		}
+		__asm__ __volatile__ (
+			"mwait"
+			: : "a" (0), "c" (0)
+			: "memory"
+			);
+	}
+}
+
+/* rdtsc is not ordered, keep it between the shared line accesses */
+static uint64_t tsc_sync_rdtsc(void)
 {
-	/* g_ready_counter++; */
+	uint64_t ret;
+
 	__asm__ __volatile__ (
-		"lock; incl %0" : : "m" (g_ready_counter)
+		"lfence\n\t"
+		"rdtsc"
+		: "=A" (ret)
+		: : "memory"
 		);
 
+	return ret;
+}
+
+/* AP side of the TSC ping-pong, see bsp_tsc_sync() */
+static void ap_tsc_sync(uint32_t slot)
+{
+	uint32_t round;
+
+	while (g_tsc_sync.slot != slot + 1) {
+		__asm__ __volatile__ (
+			"pause"
+			);
+	}
+
+	for (round = 0; round < TSC_SYNC_ROUNDS; round++) {
+		while (g_tsc_sync.seq != 2 * round + 1) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
+		g_tsc_sync.ap_tsc = tsc_sync_rdtsc();
+		g_tsc_sync.seq = 2 * round + 2;
+	}
+}
+
+void CDECL ap_continue_wakeup_code_C(uint32_t local_apic_id,
+				     ap_mailbox_t *mailbox)
+{
+	if (mailbox->deferred != 0) {
+		ap_wait_for_release(mailbox->deferred);
+	} else if (g_tsc_sync_enabled) {
+		ap_tsc_sync(mailbox - ap_mailboxes);
+	}
+
+	mailbox->launch_tsc = startap_rdtsc();
+	mailbox->ready = 1;
+	if (NULL != gp_ap_launch_counter) {
+		__asm__ __volatile__ (
+			"lock; incl %0" : "+m" (*gp_ap_launch_counter) : : "memory"
+			);
+	}
+
 	/* user_func now contains address of the function to be called */
 	g_user_func(local_apic_id, g_any_data_for_user_func);
 }
@@ -312,6 +703,17 @@ static uint8_t CDECL read_port_8(uint32_t port)
 	return val;
 }
 
+/*------------------------------------------------------------------- */
+/* write 8-bit port */
+/*-------------------------------------------------------------------- */
+static void CDECL write_port_8(uint32_t port, uint8_t val)
+{
+	__asm__ __volatile__ (
+		"outb %0, %w1"
+		: : "a" (val), "Nd" (port)
+		);
+}
+
 /******************************************************************************
  *
  *            START: REPLACING STALL() WITH RDTSC()
@@ -330,19 +732,115 @@ void startap_stall(uint32_t stall_usec)
 		read_port_8(IA32_DEBUG_IO_PORT);
 }
 
+/* TSC frequency from CPUID leaf 0x15 (crystal clock * ratio), or from the
+ * base frequency in leaf 0x16 if the crystal clock is not enumerated. */
+static boolean_t tsc_calibrate_from_cpuid(void)
+{
+	uint32_t info[4];
+	uint32_t max_leaf;
+
+	startap_cpuid(0, info);
+	max_leaf = info[0];
+
+	if (max_leaf < 0x15) {
+		return FALSE;
+	}
+
+	/* eax - denominator, ebx - numerator, ecx - crystal clock in Hz */
+	startap_cpuid(0x15, info);
+	if ((info[0] == 0) || (info[1] == 0)) {
+		return FALSE;
+	}
+
+	if (info[2] != 0) {
+		startap_tsc_ticks_per_msec =
+			div_u64_u32((uint64_t)(info[2] / 1000) * info[1], info[0]);
+		startap_tsc_source = BOOT_TSC_SOURCE_CPUID_CRYSTAL;
+		return TRUE;
+	}
+
+	if (max_leaf < 0x16) {
+		return FALSE;
+	}
+
+	/* eax[15:0] - base frequency in MHz */
+	startap_cpuid(0x16, info);
+	if ((info[0] & 0xffff) == 0) {
+		return FALSE;
+	}
+
+	startap_tsc_ticks_per_msec = (info[0] & 0xffff) * 1000;
+	startap_tsc_source = BOOT_TSC_SOURCE_CPUID_NOMINAL;
+	return TRUE;
+}
+
+/* Measure TSC ticks during a PIT channel 2 countdown of
+ * PIT_CALIBRATION_MSEC. Fails if the PIT does not count as expected. */
+static boolean_t tsc_calibrate_from_pit(void)
+{
+	uint32_t latch = PIT_FREQUENCY_HZ / (1000 / PIT_CALIBRATION_MSEC);
+	uint32_t polls = 0;
+	uint64_t start_tsc;
+	uint64_t end_tsc;
+	uint8_t gate;
+
+	/* gate channel 2 on, speaker off */
+	gate = read_port_8(PIT_CH2_GATE_PORT);
+	write_port_8(PIT_CH2_GATE_PORT,
+		(gate & ~PIT_CH2_SPEAKER) | PIT_CH2_GATE);
+
+	write_port_8(PIT_COMMAND_PORT, PIT_CH2_MODE0_BINARY);
+	write_port_8(PIT_CH2_DATA_PORT, latch & 0xff);
+	write_port_8(PIT_CH2_DATA_PORT, latch >> 8);
+
+	start_tsc = startap_rdtsc();
+	while ((read_port_8(PIT_CH2_GATE_PORT) & PIT_CH2_OUT) == 0) {
+		if (++polls > PIT_CALIBRATION_MAX_POLLS) {
+			break;
+		}
+	}
+	end_tsc = startap_rdtsc();
+
+	write_port_8(PIT_CH2_GATE_PORT, gate);
+
+	if ((polls < PIT_CALIBRATION_MIN_POLLS) ||
+	    (polls > PIT_CALIBRATION_MAX_POLLS)) {
+		return FALSE;
+	}
+
+	startap_tsc_ticks_per_msec =
+		div_u64_u32(end_tsc - start_tsc, PIT_CALIBRATION_MSEC);
+	startap_tsc_source = BOOT_TSC_SOURCE_PIT;
+	return TRUE;
+}
+
 /*======================= startap_calibrate_tsc_ticks_per_msec() ============*/
-/* Calibrate the internal variable holding the number of TSC ticks pers second.
- * Should only be called at initialization, as it relies on startap_stall() */
+/* Calibrate the internal variable holding the number of TSC ticks per msec.
+ * CPUID enumerated frequency is used if present, otherwise TSC is measured
+ * against PIT, and against port 0x80 delays as the last resort.
+ * Should only be called at initialization, as it relies on platform timers */
 void startap_calibrate_tsc_ticks_per_msec(void)
 {
-	uint32_t start_tsc = 1, end_tsc = 0;
+	uint64_t start_tsc;
 
-	while (start_tsc > end_tsc) {
-		start_tsc = (uint32_t)startap_rdtsc();
-		startap_stall(1000); /* 1 ms */
-		end_tsc = (uint32_t)startap_rdtsc();
+	if (tsc_calibrate_from_cpuid() || tsc_calibrate_from_pit()) {
+		return;
 	}
-	startap_tsc_ticks_per_msec = (end_tsc - start_tsc);
+
+	start_tsc = startap_rdtsc();
+	startap_stall(1000); /* 1 ms */
+	startap_tsc_ticks_per_msec = (uint32_t)(startap_rdtsc() - start_tsc);
+	startap_tsc_source = BOOT_TSC_SOURCE_IO_DELAY;
+}
+
+uint32_t startap_get_tsc_ticks_per_msec(void)
+{
+	return startap_tsc_ticks_per_msec;
+}
+
+uint32_t startap_get_tsc_source(void)
+{
+	return startap_tsc_source;
 }
 
 /*========================== startap_stall_using_tsc() ======================*/
@@ -351,27 +849,21 @@ void startap_calibrate_tsc_ticks_per_msec(void)
  * rough. */
 static void startap_stall_using_tsc(uint32_t stall_usec)
 {
-	uint32_t start_tsc = 1, end_tsc = 0;
+	uint64_t end_tsc;
 
 	/* Initialize startap_tsc_ticks_per_msec. Happens at boot time */
 	if (startap_tsc_ticks_per_msec == 0) {
 		startap_calibrate_tsc_ticks_per_msec();
 	}
 
-	/* Calculate the start_tsc and end_tsc */
-	/* While loop is to overcome the overflow of 32-bit rdtsc value */
-	while (start_tsc > end_tsc) {
-		end_tsc =
-			(uint32_t)startap_rdtsc() +
-			(stall_usec * startap_tsc_ticks_per_msec / 1000);
-		start_tsc = (uint32_t)startap_rdtsc();
-	}
+	end_tsc = startap_rdtsc() +
+		  div_u64_u32((uint64_t)stall_usec * startap_tsc_ticks_per_msec,
+		1000);
 
-	while (start_tsc < end_tsc) {
+	while (startap_rdtsc() < end_tsc) {
 		__asm__ __volatile__ (
 			"pause"
 			);
-		start_tsc = (uint32_t)startap_rdtsc();
 	}
 }
 
@@ -381,30 +873,148 @@ static void startap_stall_using_tsc(uint32_t stall_usec)
 *
 ***************************************************************************/
 
+/*---------------------------------------------------------------------------
+ * Count APs which already took an arrival slot
+ *---------------------------------------------------------------------------*/
+static uint32_t count_arrived_aps(void)
+{
+	uint32_t arrived = g_ap_arrival_counter;
+
+	if (arrived > NELEMENTS(ap_mailboxes)) {
+		arrived = NELEMENTS(ap_mailboxes);
+	}
+	return arrived;
+}
+
+/*---------------------------------------------------------------------------
+ * Check whether AP with the given local APIC ID already arrived
+ *---------------------------------------------------------------------------*/
+static boolean_t ap_arrived(uint32_t apic_id)
+{
+	uint32_t arrived = count_arrived_aps();
+	uint32_t i;
+
+	for (i = 0; i < arrived; ++i) {
+		if (ap_mailboxes[i].apic_id == apic_id) {
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/*---------------------------------------------------------------------------
+ * Check whether all expected APs arrived.
+ * If the list of APs is known in advance every listed AP must arrive.
+ *---------------------------------------------------------------------------*/
+static boolean_t expected_aps_arrived(uint32_t expected_aps)
+{
+	uint32_t i;
+
+	if ((expected_aps == 0) || (count_arrived_aps() < expected_aps)) {
+		return FALSE;
+	}
+
+	for (i = 0; i < g_num_of_known_aps; ++i) {
+		if (!ap_arrived(gp_known_ap_apic_ids[i])) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------
+ * Check whether all APs in the list arrived. FALSE for the empty list
+ *---------------------------------------------------------------------------*/
+static boolean_t listed_aps_arrived(const uint32_t *apic_ids, uint32_t count)
+{
+	uint32_t i;
+
+	if (count == 0) {
+		return FALSE;
+	}
+
+	for (i = 0; i < count; ++i) {
+		if (!ap_arrived(apic_ids[i])) {
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------
+ * Wait until all APs in the list report themselves, but not longer than
+ * timeout_usec. For the empty list the whole timeout is spent.
+ * Return:
+ * TRUE if all listed APs arrived
+ *---------------------------------------------------------------------------*/
+static boolean_t wait_for_listed_aps(const uint32_t *apic_ids, uint32_t count,
+				     uint32_t timeout_usec)
+{
+	uint64_t end_tsc = startap_rdtsc() +
+			   (uint64_t)timeout_usec *
+			   (startap_tsc_ticks_per_msec / 1000);
+
+	do {
+		if (listed_aps_arrived(apic_ids, count)) {
+			return TRUE;
+		}
+		__asm__ __volatile__ (
+			"pause"
+			);
+	} while (startap_rdtsc() < end_tsc);
+
+	return listed_aps_arrived(apic_ids, count);
+}
+
+/*---------------------------------------------------------------------------
+ * Wait until expected_aps APs report themselves, but not longer than
+ * timeout_usec. If expected_aps is 0 (number of APs is unknown) the whole
+ * timeout is spent.
+ * Return:
+ * TRUE if all expected APs arrived
+ *---------------------------------------------------------------------------*/
+static boolean_t wait_for_aps(uint32_t expected_aps, uint32_t timeout_usec)
+{
+	uint64_t end_tsc;
+
+	if (startap_tsc_ticks_per_msec == 0) {
+		startap_calibrate_tsc_ticks_per_msec();
+	}
+
+	end_tsc = startap_rdtsc() +
+		  (uint64_t)timeout_usec * (startap_tsc_ticks_per_msec / 1000);
+
+	do {
+		if (expected_aps_arrived(expected_aps)) {
+			return TRUE;
+		}
+		__asm__ __volatile__ (
+			"pause"
+			);
+	} while (startap_rdtsc() < end_tsc);
+
+	return expected_aps_arrived(expected_aps);
+}
+
 /*---------------------------------------------------------------------
 * send IPI
+* In x2APIC mode ICR is written with a single MSR write and there is no
+* delivery status to poll.
 *--------------------------------------------------------------------*/
 static
-void send_ipi_to_all_excluding_self(uint32_t vector_number, uint32_t delivery_mode)
+void send_ipi(ia32_icr_low_t icr_low, uint32_t dst)
 {
-	ia32_icr_low_t icr_low = { 0 };
 	ia32_icr_low_t icr_low_status = { 0 };
 	ia32_icr_high_t icr_high = { 0 };
 	uint64_t apic_base = 0;
 
-	icr_low.bits.vector = vector_number;
-	icr_low.bits.delivery_mode = delivery_mode;
-
-	/* level is set to 1 (except for INIT_DEASSERT, which is not supported in
-	 * P3 and P4) */
-	/* trigger mode is set to 0 (except for INIT_DEASSERT, which is not
-	 * supported in P3 and P4) */
-	icr_low.bits.level = 1;
-	icr_low.bits.trigger_mode = 0;
+	if (g_x2apic_mode) {
+		write_msr(IA32_MSR_X2APIC_ICR,
+			((uint64_t)dst << 32) | icr_low.uint32);
+		return;
+	}
 
-	/* broadcast mode - ALL_EXCLUDING_SELF */
-	icr_low.bits.destination_shorthand =
-		LOCAL_APIC_BROADCAST_MODE_ALL_EXCLUDING_SELF;
+	icr_high.bits.destination = (uint8_t)dst;
 
 	/* send */
 	apic_base = read_msr(IA32_MSR_APIC_BASE);
@@ -417,60 +1027,90 @@ void send_ipi_to_all_excluding_self(uint32_t vector_number, uint32_t delivery_mo
 
 	*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET_HIGH) =
 		icr_high.uint32;
-	*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET) = icr_low.uint32;;
+	*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET) = icr_low.uint32;
 
 	do {
 		startap_stall_using_tsc(10);
 		icr_low_status.uint32 =
 			*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET);
 	} while (icr_low_status.bits.delivery_status != 0);
-
-	return;
 }
 
+/*---------------------------------------------------------------------
+* send the same IPI to a list of CPUs
+* Commands are written back to back without the stall after each one. In
+* x2APIC mode ICR writes need no polling at all. In xAPIC mode ICR takes the
+* next command once the previous one is sent, so only the idle state before
+* each write and once after the last one is polled.
+*--------------------------------------------------------------------*/
 static
-void send_ipi_to_specific_cpu(uint32_t vector_number,
-			      uint32_t delivery_mode, uint8_t dst)
+void send_ipi_to_cpu_list(uint32_t vector_number, uint32_t delivery_mode,
+			  const uint32_t *dst, uint32_t count)
 {
 	ia32_icr_low_t icr_low = { 0 };
 	ia32_icr_low_t icr_low_status = { 0 };
 	ia32_icr_high_t icr_high = { 0 };
-	uint64_t apic_base = 0;
+	volatile uint32_t *icr_low_reg;
+	volatile uint32_t *icr_high_reg;
+	uint64_t apic_base;
+	uint32_t i;
 
 	icr_low.bits.vector = vector_number;
 	icr_low.bits.delivery_mode = delivery_mode;
-
-	/* level is set to 1 (except for INIT_DEASSERT, which is not supported in
-	 * P3 and P4) */
-	/* trigger mode is set to 0 (except for INIT_DEASSERT, which is not
-	 * supported in P3 and P4) */
 	icr_low.bits.level = 1;
 	icr_low.bits.trigger_mode = 0;
-
-	/* send to specific cpu */
 	icr_low.bits.destination_shorthand = LOCAL_APIC_BROADCAST_MODE_SPECIFY_CPU;
-	icr_high.bits.destination = dst;
 
-	/* send */
+	/* package leaders use it as well, so check the mode of this CPU */
 	apic_base = read_msr(IA32_MSR_APIC_BASE);
+	if (apic_base & APIC_BASE_X2APIC_ENABLED) {
+		for (i = 0; i < count; i++) {
+			write_msr(IA32_MSR_X2APIC_ICR,
+				((uint64_t)dst[i] << 32) | icr_low.uint32);
+		}
+		return;
+	}
+
 	apic_base &= LOCAL_APIC_BASE_MSR_MASK;
+	icr_low_reg = (uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET);
+	icr_high_reg =
+		(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET_HIGH);
+
+	for (i = 0; i < count; i++) {
+		do
+			icr_low_status.uint32 = *icr_low_reg;
+		while (icr_low_status.bits.delivery_status != 0);
+
+		icr_high.bits.destination = (uint8_t)dst[i];
+		*icr_high_reg = icr_high.uint32;
+		*icr_low_reg = icr_low.uint32;
+	}
 
 	do
-		icr_low_status.uint32 =
-			*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET);
+		icr_low_status.uint32 = *icr_low_reg;
 	while (icr_low_status.bits.delivery_status != 0);
+}
 
-	*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET_HIGH) =
-		icr_high.uint32;
-	*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET) = icr_low.uint32;;
+static
+void send_ipi_to_all_excluding_self(uint32_t vector_number, uint32_t delivery_mode)
+{
+	ia32_icr_low_t icr_low = { 0 };
 
-	do {
-		startap_stall_using_tsc(10);
-		icr_low_status.uint32 =
-			*(uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ICR_OFFSET);
-	} while (icr_low_status.bits.delivery_status != 0);
+	icr_low.bits.vector = vector_number;
+	icr_low.bits.delivery_mode = delivery_mode;
+
+	/* level is set to 1 (except for INIT_DEASSERT, which is not supported in
+	 * P3 and P4) */
+	/* trigger mode is set to 0 (except for INIT_DEASSERT, which is not
+	 * supported in P3 and P4) */
+	icr_low.bits.level = 1;
+	icr_low.bits.trigger_mode = 0;
+
+	/* broadcast mode - ALL_EXCLUDING_SELF */
+	icr_low.bits.destination_shorthand =
+		LOCAL_APIC_BROADCAST_MODE_ALL_EXCLUDING_SELF;
 
-	return;
+	send_ipi(icr_low, 0);
 }
 
 static
@@ -479,66 +1119,449 @@ void send_init_ipi(void)
 	send_ipi_to_all_excluding_self(0, LOCAL_APIC_DELIVERY_MODE_INIT);
 }
 
+/* Remember when the next SIPI round starts */
+static
+void record_sipi_round(void)
+{
+	if (g_sipi_rounds < AP_SIPI_ROUNDS) {
+		g_sipi_tsc[g_sipi_rounds++] = startap_rdtsc();
+	}
+}
+
 static
 void send_sipi_ipi(void *code_start)
 {
+	record_sipi_round();
+
 	/* SIPI message contains address of the code, shifted right to 12 bits */
 	send_ipi_to_all_excluding_self(((uint32_t)code_start) >> 12,
 		LOCAL_APIC_DELIVERY_MODE_SIPI);
 }
 
 /*----------------------------------------------------------------------------
-* Send INIT IPI - SIPI to all APs in broadcast mode
+* Send INIT IPI - SIPI to all APs in broadcast mode, first half: INIT and the
+* first SIPI
 *---------------------------------------------------------------------------*/
 static
-void send_broadcast_init_sipi(init32_struct_t *p_init32_data)
+void send_broadcast_init_first_sipi(init32_struct_t *p_init32_data)
 {
 	send_init_ipi();
 	/* timeout according to manual - 10 miliseconds */
-	startap_stall_using_tsc(10000);
+	startap_stall_using_tsc(INIT_TO_SIPI_DELAY_IN_MICROS);
 	/* SIPI message contains address of the code, shifted right to 12 bits */
-	/* send it twice - according to manual */
 	send_sipi_ipi((void *)p_init32_data->i32_low_memory_page);
+}
+
+/*----------------------------------------------------------------------------
+* Send INIT IPI - SIPI to all APs in broadcast mode, second half: the second
+* SIPI, sent only if not all expected APs arrived after the first one. If the
+* number of APs is unknown (expected_aps is 0) the fixed schedule from the
+* manual is used.
+*---------------------------------------------------------------------------*/
+static
+void send_broadcast_second_sipi(init32_struct_t *p_init32_data,
+				uint32_t expected_aps)
+{
 	/* timeout according to manual - 200 miliseconds */
-	startap_stall_using_tsc(200000);
+	if (wait_for_aps(expected_aps, SIPI_TO_SIPI_TIMEOUT_IN_MICROS)) {
+		return;
+	}
 	send_sipi_ipi((void *)p_init32_data->i32_low_memory_page);
 	/* timeout according to manual - 200 miliseconds */
-	startap_stall_using_tsc(200000);
+	wait_for_aps(expected_aps, SIPI_TO_SIPI_TIMEOUT_IN_MICROS);
 }
 
 /*----------------------------------------------------------------------------
-* Send INIT IPI - SIPI to all active APs
+* Send INIT IPI - SIPI to all APs in broadcast mode
+* SIPI is sent twice according to manual
 *---------------------------------------------------------------------------*/
 static
-void send_targeted_init_sipi(init32_struct_t *p_init32_data,
-			     mon_startup_struct_t *p_startup)
+void send_broadcast_init_sipi(init32_struct_t *p_init32_data,
+			      uint32_t expected_aps)
 {
-	int i;
+	send_broadcast_init_first_sipi(p_init32_data);
+	send_broadcast_second_sipi(p_init32_data, expected_aps);
+}
 
-	for (i = 0; i < p_startup->number_of_processors_at_boot_time - 1; i++)
-		send_ipi_to_specific_cpu(0, LOCAL_APIC_DELIVERY_MODE_INIT,
-			p_startup->cpu_local_apic_ids[i + 1]);
+/*----------------------------------------------------------------------------
+* Send INIT IPI - SIPI to the known APs (gp_known_ap_apic_ids)
+* Each round of IPIs is sent as one batch (send_ipi_to_cpu_list).
+* The second SIPI is sent only to APs which did not arrive after the first one.
+*---------------------------------------------------------------------------*/
+static
+void send_targeted_init_sipi(init32_struct_t *p_init32_data,
+			     uint32_t expected_aps)
+{
+	static uint32_t late_ap_apic_ids[MON_MAX_CPU_SUPPORTED];
+	uint32_t sipi_vector =
+		((uint32_t)p_init32_data->i32_low_memory_page) >> 12;
+	uint32_t late_aps = 0;
+	uint32_t i;
+
+	send_ipi_to_cpu_list(0, LOCAL_APIC_DELIVERY_MODE_INIT,
+		gp_known_ap_apic_ids, g_num_of_known_aps);
 	/* timeout according to manual - 10 miliseconds */
-	startap_stall_using_tsc(10000);
+	startap_stall_using_tsc(INIT_TO_SIPI_DELAY_IN_MICROS);
 
 	/* SIPI message contains address of the code, shifted right to 12 bits */
 	/* send it twice - according to manual */
-	for (i = 0; i < p_startup->number_of_processors_at_boot_time - 1; i++) {
-		send_ipi_to_specific_cpu(
-			((uint32_t)p_init32_data->i32_low_memory_page) >> 12,
-			LOCAL_APIC_DELIVERY_MODE_SIPI,
-			p_startup->cpu_local_apic_ids[i + 1]);
+	record_sipi_round();
+	send_ipi_to_cpu_list(sipi_vector, LOCAL_APIC_DELIVERY_MODE_SIPI,
+		gp_known_ap_apic_ids, g_num_of_known_aps);
+	/* timeout according to manual - 200 miliseconds */
+	if (wait_for_aps(expected_aps, SIPI_TO_SIPI_TIMEOUT_IN_MICROS)) {
+		return;
+	}
+	for (i = 0; i < g_num_of_known_aps; i++) {
+		if (!ap_arrived(gp_known_ap_apic_ids[i])) {
+			late_ap_apic_ids[late_aps++] = gp_known_ap_apic_ids[i];
+		}
 	}
+	record_sipi_round();
+	send_ipi_to_cpu_list(sipi_vector, LOCAL_APIC_DELIVERY_MODE_SIPI,
+		late_ap_apic_ids, late_aps);
 	/* timeout according to manual - 200 miliseconds */
-	startap_stall_using_tsc(200000);
-	for (i = 0; i < p_startup->number_of_processors_at_boot_time - 1; i++) {
-		send_ipi_to_specific_cpu(
-			((uint32_t)p_init32_data->i32_low_memory_page) >> 12,
-			LOCAL_APIC_DELIVERY_MODE_SIPI,
-			p_startup->cpu_local_apic_ids[i + 1]);
+	wait_for_aps(expected_aps, SIPI_TO_SIPI_TIMEOUT_IN_MICROS);
+}
+
+/*---------------------------------------------------------------------------
+ * Local APIC ID of this CPU
+ *---------------------------------------------------------------------------*/
+static uint32_t get_local_apic_id(void)
+{
+	uint64_t apic_base = read_msr(IA32_MSR_APIC_BASE);
+
+	if (apic_base & APIC_BASE_X2APIC_ENABLED) {
+		return (uint32_t)read_msr(IA32_MSR_X2APIC_APICID);
+	}
+
+	apic_base &= LOCAL_APIC_BASE_MSR_MASK;
+	return *(volatile uint32_t *)(uint32_t)(apic_base + LOCAL_APIC_ID_OFFSET) >>
+	       24;
+}
+
+/*---------------------------------------------------------------------------
+ * Find package line of the package, add it if it is not there yet.
+ * Return:
+ * package index or AP_MAX_PACKAGES if there is no room
+ *---------------------------------------------------------------------------*/
+static uint32_t get_package_index(uint32_t package_id)
+{
+	uint32_t p;
+
+	for (p = 0; p < g_ap_num_packages; p++) {
+		if (g_ap_packages[p].package_id == package_id) {
+			return p;
+		}
+	}
+
+	if (g_ap_num_packages == AP_MAX_PACKAGES) {
+		return AP_MAX_PACKAGES;
+	}
+
+	mon_memset(&g_ap_packages[p], 0, sizeof(ap_package_t));
+	g_ap_packages[p].package_id = package_id;
+	g_ap_packages[p].leader_apic_id = AP_APIC_ID_INVALID;
+	g_ap_packages[p].leader_stack =
+		(uint32_t)g_ap_leader_stacks[p] + AP_LEADER_STACK_SIZE;
+	g_ap_num_packages++;
+	return p;
+}
+
+/*---------------------------------------------------------------------------
+ * Split the known APs by packages and choose package leaders for the two
+ * level wakeup. The first known AP of every package but the BSP's one is
+ * the leader, the rest are its siblings. BSP wakes the leaders and APs of
+ * its own package.
+ * Return:
+ * FALSE if the two level wakeup is not worth it (single package) or not
+ * possible (too many packages), g_ap_num_packages is 0 then
+ *---------------------------------------------------------------------------*/
+static boolean_t setup_package_leaders(void)
+{
+	uint32_t p;
+	uint32_t i;
+
+	g_ap_num_packages = 0;
+	g_num_of_bsp_targets = 0;
+	g_ap_package_shift = get_package_id_shift();
+
+	/* the package of BSP goes first, BSP is its leader */
+	p = get_package_index(get_local_apic_id() >> g_ap_package_shift);
+	g_ap_packages[p].leader_apic_id = get_local_apic_id();
+
+	for (i = 0; i < g_num_of_known_aps; i++) {
+		p = get_package_index(gp_known_ap_apic_ids[i] >>
+			g_ap_package_shift);
+		if (p == AP_MAX_PACKAGES) {
+			g_ap_num_packages = 0;
+			return FALSE;
+		}
+		if ((p != 0) &&
+		    (g_ap_packages[p].leader_apic_id == AP_APIC_ID_INVALID)) {
+			g_ap_packages[p].leader_apic_id = gp_known_ap_apic_ids[i];
+			g_bsp_target_apic_ids[g_num_of_bsp_targets++] =
+				gp_known_ap_apic_ids[i];
+		}
+	}
+
+	if (g_ap_num_packages < 2) {
+		g_ap_num_packages = 0;
+		return FALSE;
+	}
+
+	/* siblings of every package are kept together */
+	i = 0;
+	for (p = 0; p < g_ap_num_packages; p++) {
+		uint32_t j;
+
+		g_ap_packages[p].first_sibling = i;
+		for (j = 0; j < g_num_of_known_aps; j++) {
+			if (((gp_known_ap_apic_ids[j] >> g_ap_package_shift) ==
+			     g_ap_packages[p].package_id) &&
+			    (gp_known_ap_apic_ids[j] !=
+			     g_ap_packages[p].leader_apic_id)) {
+				g_package_ap_apic_ids[i++] = gp_known_ap_apic_ids[j];
+			}
+		}
+		g_ap_packages[p].sibling_count = i - g_ap_packages[p].first_sibling;
+	}
+
+	/* BSP is the leader of its own package */
+	for (i = 0; i < g_ap_packages[0].sibling_count; i++) {
+		g_bsp_target_apic_ids[g_num_of_bsp_targets++] =
+			g_package_ap_apic_ids[g_ap_packages[0].first_sibling + i];
 	}
+
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------------
+ * Wait until all APs of the package check in on the package line, but not
+ * longer than timeout_usec. Runs on package leaders.
+ *---------------------------------------------------------------------------*/
+static boolean_t wait_for_package(const ap_package_t *package,
+				  uint32_t timeout_usec)
+{
+	uint64_t end_tsc = startap_rdtsc() +
+			   (uint64_t)timeout_usec *
+			   (startap_tsc_ticks_per_msec / 1000);
+
+	/* the leader checked in as well */
+	while (package->arrived <= package->sibling_count) {
+		if (startap_rdtsc() >= end_tsc) {
+			return FALSE;
+		}
+		__asm__ __volatile__ (
+			"pause"
+			);
+	}
+	return TRUE;
+}
+
+/* Remember when the next SIPI round to siblings of the package starts */
+static void record_package_sipi_round(ap_package_t *package)
+{
+	if (package->sipi_rounds < AP_SIPI_ROUNDS) {
+		package->sipi_tsc[package->sipi_rounds++] = startap_rdtsc();
+	}
+}
+
+/*---------------------------------------------------------------------------
+ * Take the package for waking up its siblings. Leader and BSP race for it,
+ * so siblings are woken once.
+ * Return:
+ * FALSE if the package was taken by the other one
+ *---------------------------------------------------------------------------*/
+static boolean_t claim_package(ap_package_t *package)
+{
+	uint32_t prev;
+
+	__asm__ __volatile__ (
+		"lock; cmpxchgl %2, %1"
+		: "=a" (prev), "+m" (package->claimed)
+		: "r" (1), "0" (0)
+		: "memory"
+		);
+
+	return prev == 0;
+}
+
+/*---------------------------------------------------------------------------
+ * Wake up siblings of the package with INIT-SIPI-SIPI and wait for them.
+ * Called by the package leader in stage 1 on its leader stack, see
+ * wakeup_init64.S, and by BSP if the leader did not come up. A leader
+ * which comes up after BSP took its package, or after the enumeration,
+ * leaves the siblings alone.
+ *---------------------------------------------------------------------------*/
+void CDECL ap_leader_wake_package(uint32_t package_index)
+{
+	ap_package_t *package = &g_ap_packages[package_index];
+	const uint32_t *siblings = &g_package_ap_apic_ids[package->first_sibling];
+	uint32_t i;
+
+	if ((mp_bootstrap_state.state != MP_BOOTSTRAP_STATE_INIT) ||
+	    !claim_package(package)) {
+		return;
+	}
+
+	send_ipi_to_cpu_list(0, LOCAL_APIC_DELIVERY_MODE_INIT, siblings,
+		package->sibling_count);
+	/* timeout according to manual - 10 miliseconds */
+	startap_stall_using_tsc(INIT_TO_SIPI_DELAY_IN_MICROS);
+	record_package_sipi_round(package);
+	send_ipi_to_cpu_list(g_ap_sipi_vector, LOCAL_APIC_DELIVERY_MODE_SIPI,
+		siblings, package->sibling_count);
+
+	/* timeout according to manual - 200 miliseconds */
+	if (!wait_for_package(package, SIPI_TO_SIPI_TIMEOUT_IN_MICROS)) {
+		record_package_sipi_round(package);
+		for (i = 0; i < package->sibling_count; i++) {
+			if (!ap_arrived(siblings[i])) {
+				send_ipi_to_cpu_list(g_ap_sipi_vector,
+					LOCAL_APIC_DELIVERY_MODE_SIPI, &siblings[i], 1);
+			}
+		}
+		wait_for_package(package, SIPI_TO_SIPI_TIMEOUT_IN_MICROS);
+	}
+
+	/* report up */
+	package->done = 1;
+}
+
+/*----------------------------------------------------------------------------
+* Two level wakeup, first half: INIT and the first SIPI to package leaders
+* and APs of the BSP package
+*---------------------------------------------------------------------------*/
+static
+void send_leaders_init_first_sipi(void)
+{
+	send_ipi_to_cpu_list(0, LOCAL_APIC_DELIVERY_MODE_INIT,
+		g_bsp_target_apic_ids, g_num_of_bsp_targets);
+	/* timeout according to manual - 10 miliseconds */
+	startap_stall_using_tsc(INIT_TO_SIPI_DELAY_IN_MICROS);
+	record_sipi_round();
+	send_ipi_to_cpu_list(g_ap_sipi_vector, LOCAL_APIC_DELIVERY_MODE_SIPI,
+		g_bsp_target_apic_ids, g_num_of_bsp_targets);
+}
+
+/*----------------------------------------------------------------------------
+* Two level wakeup, second half: the second SIPI to late leaders and APs of
+* the BSP package, then wait for leaders to report their packages done.
+* Siblings of a leader which did not come up are woken up from BSP.
+*---------------------------------------------------------------------------*/
+static
+void send_leaders_second_sipi(void)
+{
+	uint64_t end_tsc;
+	uint32_t p;
+	uint32_t i;
+
 	/* timeout according to manual - 200 miliseconds */
-	startap_stall_using_tsc(200000);
+	if (!wait_for_listed_aps(g_bsp_target_apic_ids, g_num_of_bsp_targets,
+		    SIPI_TO_SIPI_TIMEOUT_IN_MICROS)) {
+		record_sipi_round();
+		for (i = 0; i < g_num_of_bsp_targets; i++) {
+			if (!ap_arrived(g_bsp_target_apic_ids[i])) {
+				send_ipi_to_cpu_list(g_ap_sipi_vector,
+					LOCAL_APIC_DELIVERY_MODE_SIPI,
+					&g_bsp_target_apic_ids[i], 1);
+			}
+		}
+		wait_for_listed_aps(g_bsp_target_apic_ids, g_num_of_bsp_targets,
+			SIPI_TO_SIPI_TIMEOUT_IN_MICROS);
+	}
+	g_ap_packages[0].done = 1;
+
+	/* a leader gives up on its siblings after INIT-SIPI-SIPI */
+	end_tsc = startap_rdtsc() +
+		  (uint64_t)LEADER_TIMEOUT_IN_MICROS *
+		  (startap_tsc_ticks_per_msec / 1000);
+
+	for (p = 1; p < g_ap_num_packages; p++) {
+		/* returns at once if the leader took the package meanwhile */
+		if (!ap_arrived(g_ap_packages[p].leader_apic_id)) {
+			ap_leader_wake_package(p);
+		}
+		while ((g_ap_packages[p].done == 0) &&
+		       (startap_rdtsc() < end_tsc)) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
+		/* the leader checked in but did not take the package yet */
+		if (g_ap_packages[p].done == 0) {
+			ap_leader_wake_package(p);
+		}
+	}
+}
+
+/*---------------------------------------------------------------------------
+ * Remember APs enumerated at the first boot for S3 resume, with their final
+ * ordered IDs and park indexes
+ *---------------------------------------------------------------------------*/
+static void save_boot_aps(void)
+{
+	uint32_t arrived = count_arrived_aps();
+	uint32_t ordered_id;
+	uint32_t i;
+
+	g_num_of_boot_aps = 0;
+	for (i = 0; i < arrived; ++i) {
+		ordered_id = ap_mailboxes[i].ordered_id;
+		if (ordered_id == 0) {
+			continue;
+		}
+
+		g_boot_ap_apic_ids[ordered_id - 1] = ap_mailboxes[i].apic_id;
+		g_boot_ap_deferred[ordered_id - 1] = ap_mailboxes[i].deferred;
+		if (ordered_id > g_num_of_boot_aps) {
+			g_num_of_boot_aps = ordered_id;
+		}
+	}
+	gp_boot_ap_release = (g_num_of_deferred_aps != 0) ? gp_ap_release : NULL;
+	g_boot_aps_saved = TRUE;
+}
+
+/*---------------------------------------------------------------------------
+ * Give APs back on S3 resume the ordered IDs and park indexes they had at
+ * the first boot. Deferred APs which xmon released before go at once, the
+ * release word keeps its value.
+ * Return:
+ * Number of deferred APs
+ *---------------------------------------------------------------------------*/
+static uint32_t restore_boot_aps(void)
+{
+	uint32_t arrived = count_arrived_aps();
+	uint32_t max_aps = gp_init32_data->i32_num_of_aps;
+	uint32_t deferred = 0;
+	uint32_t i;
+	uint32_t k;
+
+	g_aps_counter = 0;
+	for (i = 0; i < arrived; ++i) {
+		ap_mailboxes[i].ordered_id = 0;
+		ap_mailboxes[i].deferred = 0;
+
+		for (k = 0; (k < g_num_of_boot_aps) && (k < max_aps); k++) {
+			if (g_boot_ap_apic_ids[k] == ap_mailboxes[i].apic_id) {
+				break;
+			}
+		}
+		if ((k == g_num_of_boot_aps) || (k == max_aps)) {
+			continue;
+		}
+
+		ap_mailboxes[i].ordered_id = k + 1;
+		g_aps_counter++;
+		if ((g_boot_ap_deferred[k] != 0) && (NULL != gp_boot_ap_release)) {
+			ap_mailboxes[i].deferred = g_boot_ap_deferred[k];
+			deferred++;
+		}
+	}
+
+	gp_ap_release = gp_boot_ap_release;
+	return deferred;
 }
 
 /*---------------------------------------------------------------------------
@@ -549,7 +1572,15 @@ void send_targeted_init_sipi(init32_struct_t *p_init32_data,
  * p_init32_data - contains pointer to the free low memory page to be used
  * for bootstap. After the return this memory is free
  * p_startup - contains local apic ids of active cpus to be used in post-os
- * launch
+ * launch, may be NULL in pre-os launch
+ * With INIT32_FLAG_KICK_APS_ONLY in pre-os launch only INIT and the first
+ * SIPI are sent and 0 is returned. The next call with
+ * INIT32_FLAG_APS_ALREADY_STARTED completes the startup of these APs.
+ * With INIT32_FLAG_ASYNC_AP_LAUNCH and a launch counter set,
+ * ap_procs_run() returns without waiting for APs.
+ * A pre-os launch call after the first boot completed is S3 resume. Only
+ * the APs enumerated at the first boot are woken up then, and init32 is
+ * taken as xmon fills it: no flags, AP stack pool or list of known APs.
  * Return:
  * number of processors that were init (not including BSP)
  * or -1 on errors
@@ -557,17 +1588,125 @@ void send_targeted_init_sipi(init32_struct_t *p_init32_data,
 uint32_t ap_procs_startup(init32_struct_t *p_init32_data,
 			  mon_startup_struct_t *p_startup)
 {
+	uint32_t expected_aps;
+	uint32_t cpuid_info[4];
+	boolean_t post_os_launch;
+	static uint32_t post_os_ap_apic_ids[MON_MAX_CPU_SUPPORTED];
+	uint32_t i;
+
 	if (NULL == p_init32_data || 0 == p_init32_data->i32_low_memory_page) {
 		return (uint32_t)(-1);
 	}
 
-	/* -------- Stage 1 ---------- */
+	post_os_launch = (NULL != p_startup) &&
+			 BITMAP_GET(p_startup->flags,
+		MON_STARTUP_POST_OS_LAUNCH_MODE) != 0;
+
+	g_s3_resume = ap_procs_is_s3_resume(p_startup);
+	if (g_s3_resume) {
+		p_init32_data->i32_flags = 0;
+	}
+
+	/* the exact number of APs allows to stop waiting as soon as all of them
+	 * arrived, otherwise the whole predefined timeouts are spent */
+	if (post_os_launch) {
+		g_num_of_known_aps = 0;
+		for (i = 1; (i < (uint32_t)p_startup->number_of_processors_at_boot_time) &&
+		     (i <= NELEMENTS(post_os_ap_apic_ids)); i++) {
+			post_os_ap_apic_ids[g_num_of_known_aps++] =
+				p_startup->cpu_local_apic_ids[i];
+		}
+		gp_known_ap_apic_ids = post_os_ap_apic_ids;
+	} else if (g_s3_resume) {
+		gp_known_ap_apic_ids = g_boot_ap_apic_ids;
+		g_num_of_known_aps = g_num_of_boot_aps;
+	} else {
+		gp_known_ap_apic_ids = p_init32_data->i32_ap_apic_ids;
+		g_num_of_known_aps = p_init32_data->i32_num_of_known_aps;
+	}
+	expected_aps = g_num_of_known_aps;
 
-	ap_intialize_environment();
+	/* no AP was started at the first boot, nothing to wait for */
+	if (g_s3_resume && (expected_aps == 0)) {
+		g_aps_counter = 0;
+		return 0;
+	}
+#ifdef FIXED_INIT_SIPI_SCHEDULE
+	expected_aps = 0;
+#endif
 
 	/* store in global var, to ease access to it from asm code */
 	gp_init32_data = p_init32_data;
 
+	/* nobody could wait for APs without the counter */
+	g_ap_launch_async =
+		(p_init32_data->i32_flags & INIT32_FLAG_ASYNC_AP_LAUNCH) &&
+		(NULL != gp_ap_launch_counter);
+
+	if (p_init32_data->i32_flags & INIT32_FLAG_APS_ALREADY_STARTED) {
+		/* APs got INIT and the first SIPI in the INIT32_FLAG_KICK_APS_ONLY
+		 * call, and checked in while the caller was busy */
+		if (g_ap_num_packages != 0) {
+			send_leaders_second_sipi();
+		} else {
+			send_broadcast_second_sipi(p_init32_data, expected_aps);
+		}
+	} else {
+		/* -------- Stage 1 ---------- */
+
+		ap_intialize_environment();
+
+		g_x2apic_mode =
+			(read_msr(IA32_MSR_APIC_BASE) & APIC_BASE_X2APIC_ENABLED) != 0;
+
+		/* parked APs leave the core to their SMT siblings if MWAIT is there */
+		startap_cpuid(1, cpuid_info);
+		g_ap_wait_mwait = (cpuid_info[2] & CPUID_1_ECX_MONITOR) != 0;
+
+		/* create AP startup code in low memory. Kicked APs wait for
+		 * paging to be set up, so they always use protected mode code */
+		g_ap_long_mode = FALSE;
+		if ((p_init32_data->i32_flags & INIT32_FLAG_AP_LONG_MODE) &&
+		    (NULL != gp_ap_init64) &&
+		    !(p_init32_data->i32_flags & INIT32_FLAG_KICK_APS_ONLY)) {
+			g_ap_long_mode = setup_low_memory_ap_code64(
+				p_init32_data->i32_low_memory_page);
+		}
+		if (!g_ap_long_mode) {
+			setup_low_memory_ap_code(p_init32_data->i32_low_memory_page);
+		}
+
+		/* leaders run stage 1 protected mode code only */
+		g_ap_sipi_vector = p_init32_data->i32_low_memory_page >> 12;
+		g_ap_num_packages = 0;
+#if !defined(FLAT_AP_WAKEUP) && !defined(FIXED_INIT_SIPI_SCHEDULE)
+		if (!g_ap_long_mode && (g_num_of_known_aps != 0)) {
+			setup_package_leaders();
+		}
+#endif
+
+		if (!post_os_launch &&
+		    (p_init32_data->i32_flags & INIT32_FLAG_KICK_APS_ONLY)) {
+			if (g_ap_num_packages != 0) {
+				send_leaders_init_first_sipi();
+			} else {
+				send_broadcast_init_first_sipi(p_init32_data);
+			}
+			return 0;
+		}
+
+		if (g_ap_num_packages != 0) {
+			send_leaders_init_first_sipi();
+			send_leaders_second_sipi();
+		} else if (!post_os_launch && !g_s3_resume) {
+			send_broadcast_init_sipi(p_init32_data, expected_aps);
+		} else {
+			send_targeted_init_sipi(p_init32_data, expected_aps);
+		}
+	}
+
+	/* APs load GDT and IDT in stage 2, take them now as they may have
+	 * changed since the APs were kicked */
 	__asm__ __volatile__ (
 		"sgdt %0\n\t"
 		"sidt %1"
@@ -575,22 +1714,195 @@ uint32_t ap_procs_startup(init32_struct_t *p_init32_data,
 		: "memory"
 		);
 
-	/* create AP startup code in low memory */
-	setup_low_memory_ap_code(p_init32_data->i32_low_memory_page);
+	/* wait for predefined timeout, or until all expected APs arrived */
+	wait_for_aps(expected_aps, INITIAL_WAIT_FOR_APS_TIMEOUT_IN_MILIS);
+
+	/* -------- Stage 2 ---------- */
+	g_aps_counter = bsp_enumerate_aps();
+
+	/* nobody could release deferred APs without the release word */
+	g_num_of_deferred_aps = 0;
+	if (g_s3_resume) {
+		g_num_of_deferred_aps = restore_boot_aps();
+	} else if (!post_os_launch) {
+		if ((NULL != gp_ap_release) &&
+		    (p_init32_data->i32_flags &
+		     (INIT32_FLAG_LAZY_APS | INIT32_FLAG_LAZY_SMT))) {
+			g_num_of_deferred_aps = defer_lazy_aps(p_init32_data);
+		}
+		if (NULL != gp_ap_release) {
+			*gp_ap_release = 0;
+		}
+		save_boot_aps();
+	}
 
-	if (BITMAP_GET(p_startup->flags, MON_STARTUP_POST_OS_LAUNCH_MODE) == 0) {
-		send_broadcast_init_sipi(p_init32_data);
+	for (i = 0; (i < NELEMENTS(g_ap_esp)) &&
+	     (i < NELEMENTS(p_init32_data->i32_esp)); i++) {
+		g_ap_esp[i] = p_init32_data->i32_esp[i];
+	}
+
+	return g_aps_counter;
+}
+
+/*---------------------------------------------------------------------------
+ * Take the next chunk of the bulk memory job, the same way as APs do in
+ * wakeup_init64.S, and run it.
+ * Return:
+ * FALSE if no chunks are left
+ *---------------------------------------------------------------------------*/
+static boolean_t bulk_job_run_chunk(void)
+{
+	volatile mp_bootstrap_line_t *line = &mp_bootstrap_state;
+	uint32_t claim = line->job_claim;
+	uint32_t chunk = claim & AP_BULK_CHUNK_MASK;
+	uint32_t prev;
+	uint32_t offset;
+	uint32_t size;
+
+	/* job_chunks is read after the claim, see ap_procs_bulk_mem_op() */
+	if (chunk >= line->job_chunks) {
+		return FALSE;
+	}
+
+	__asm__ __volatile__ (
+		"lock; cmpxchgl %2, %1"
+		: "=a" (prev), "+m" (line->job_claim)
+		: "r" (claim + 1), "0" (claim)
+		: "memory"
+		);
+
+	/* taken by an AP, try the next one */
+	if (prev != claim) {
+		return TRUE;
+	}
+
+	/* the job can not end while the chunk is held */
+	if (chunk >= line->job_chunks) {
+		return FALSE;
+	}
+
+	offset = chunk * line->job_chunk_size;
+	size = line->job_size - offset;
+	if (size > line->job_chunk_size) {
+		size = line->job_chunk_size;
+	}
+
+	if (line->job_op == AP_BULK_OP_COPY) {
+		mon_memcpy((void *)(line->job_dst + offset),
+			(void *)(line->job_src + offset), size);
 	} else {
-		send_targeted_init_sipi(p_init32_data, p_startup);
+		mon_memset((void *)(line->job_dst + offset), (char)line->job_src,
+			size);
 	}
 
-	/* wait for predefined timeout */
-	startap_stall_using_tsc(INITIAL_WAIT_FOR_APS_TIMEOUT_IN_MILIS);
+	__asm__ __volatile__ (
+		"lock; incl %0" : "+m" (line->job_done_chunks) : : "memory"
+		);
 
-	/* -------- Stage 2 ---------- */
-	g_aps_counter = bsp_enumerate_aps();
+	return TRUE;
+}
 
-	return g_aps_counter;
+/*---------------------------------------------------------------------------
+ * Split memcpy/memset into AP_BULK_CHUNK_SIZE chunks and run them on BSP
+ * and on APs waiting in stage 1, see mon_bulk_mem_op_t.
+ * Can be used between the INIT32_FLAG_KICK_APS_ONLY call and the final
+ * startup of the APs only.
+ * Return:
+ * non-zero when done, 0 if there are no APs to help
+ *---------------------------------------------------------------------------*/
+int ap_procs_bulk_mem_op(void *dest, const void *src, char val,
+			 unsigned int count)
+{
+	volatile mp_bootstrap_line_t *line = &mp_bootstrap_state;
+	uint32_t chunks = (count + AP_BULK_CHUNK_SIZE - 1) / AP_BULK_CHUNK_SIZE;
+
+	if ((line->state != MP_BOOTSTRAP_STATE_INIT) ||
+	    (count_arrived_aps() == 0) || (chunks < 2) ||
+	    (chunks > AP_BULK_CHUNK_MASK)) {
+		return 0;
+	}
+
+	line->job_done_chunks = 0;
+	line->job_op = (src != NULL) ? AP_BULK_OP_COPY : AP_BULK_OP_SET;
+	line->job_dst = (uint32_t)dest;
+	line->job_src = (src != NULL) ? (uint32_t)src : (uint8_t)val;
+	line->job_size = count;
+	line->job_chunk_size = AP_BULK_CHUNK_SIZE;
+
+	/* stores are not reordered. A new generation in the claim word fails
+	 * the claims of APs which read it for the previous job, and APs see
+	 * the job set once chunks is set */
+	line->job_claim = (line->job_claim & ~AP_BULK_CHUNK_MASK) +
+			  AP_BULK_GENERATION;
+	line->job_chunks = chunks;
+
+	while (bulk_job_run_chunk()) {
+	}
+
+	while (line->job_done_chunks != chunks) {
+		__asm__ __volatile__ (
+			"pause"
+			);
+	}
+
+	/* all chunks are taken, so nobody looks at the job any more */
+	line->job_chunks = 0;
+
+	return 1;
+}
+
+/*---------------------------------------------------------------------------
+ * Measure the TSC offset of the AP in arrival slot 'slot' against BSP. The
+ * AP reads its TSC between BSP readings t0 and t1, so with synchronized
+ * TSCs it is in [t0, t1]. The offset is taken from the round with the
+ * shortest round trip against its middle.
+ *---------------------------------------------------------------------------*/
+static void bsp_tsc_sync(uint32_t slot)
+{
+	ap_mailbox_t *mailbox = &ap_mailboxes[slot];
+	uint64_t best_rtt = (uint64_t)(-1);
+	int64_t best_offset = 0;
+	uint32_t round;
+
+	g_tsc_sync.seq = 0;
+	g_tsc_sync.slot = slot + 1;
+
+	for (round = 0; round < TSC_SYNC_ROUNDS; round++) {
+		uint64_t t0;
+		uint64_t t1;
+		uint64_t ap_tsc;
+
+		t0 = tsc_sync_rdtsc();
+		g_tsc_sync.seq = 2 * round + 1;
+		while (g_tsc_sync.seq != 2 * round + 2) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
+		t1 = tsc_sync_rdtsc();
+		ap_tsc = g_tsc_sync.ap_tsc;
+
+		if ((ap_tsc < t0) || (ap_tsc > t1)) {
+			mailbox->tsc_skewed = 1;
+		}
+
+		if ((t1 - t0) < best_rtt) {
+			best_rtt = t1 - t0;
+			best_offset = (int64_t)(ap_tsc - (t0 + best_rtt / 2));
+		}
+	}
+
+	if (best_offset > 0x7FFFFFFF) {
+		best_offset = 0x7FFFFFFF;
+	} else if (best_offset < -0x7FFFFFFF) {
+		best_offset = -0x7FFFFFFF;
+	}
+	mailbox->tsc_offset = (int32_t)best_offset;
+	mailbox->tsc_rtt = (best_rtt > 0xFFFFFFFF) ? 0xFFFFFFFF :
+			   (uint32_t)best_rtt;
+	if (mailbox->tsc_rtt == 0) {
+		mailbox->tsc_rtt = 1;
+	}
 }
 
 /*---------------------------------------------------------------------------
@@ -598,6 +1910,8 @@ uint32_t ap_procs_startup(init32_struct_t *p_init32_data,
  * If user function returns it should return in the protected 32bit mode. In
  * this
  * case APs enter the wait state once more.
+ * With asynchronous launch it returns as soon as APs are signaled, the
+ * launch counter tells when they are gone.
  * Input:
  * continue_ap_boot_func - user given function to continue AP boot
  * any_data - data to be passed to the function
@@ -606,45 +1920,571 @@ uint32_t ap_procs_startup(init32_struct_t *p_init32_data,
  *---------------------------------------------------------------------------*/
 void ap_procs_run(func_continue_ap_t continue_ap_boot_func, void *any_data)
 {
+	uint32_t arrived = count_arrived_aps();
+	uint32_t i;
+
 	g_user_func = continue_ap_boot_func;
 	g_any_data_for_user_func = any_data;
 
+	/* APs meet BSP in "C" code only if it waits for them there */
+	g_tsc_sync_enabled = !g_ap_launch_async && !g_ap_long_mode;
+	g_tsc_sync.slot = 0;
+
 	/* signal to APs to pass to the next stage */
 	mp_set_bootstrap_state(MP_BOOTSTRAP_STATE_APS_ENUMERATED);
 
-	/* wait until all APs will accept this */
-	while (g_ready_counter != g_aps_counter) {
-		__asm__ __volatile__ (
-			"pause"
-			);
+	if (g_ap_launch_async) {
+		return;
+	}
+
+	if (g_tsc_sync_enabled) {
+		for (i = 0; i < arrived; ++i) {
+			if ((ap_mailboxes[i].ordered_id != 0) &&
+			    (ap_mailboxes[i].deferred == 0)) {
+				bsp_tsc_sync(i);
+			}
+		}
+		g_tsc_sync.slot = 0;
+	}
+
+	/* wait until all APs will accept this. Ready flags are never cleared,
+	 * so each mailbox is waited for once, in order */
+	for (i = 0; i < arrived; ++i) {
+		if ((ap_mailboxes[i].ordered_id == 0) ||
+		    (ap_mailboxes[i].deferred != 0)) {
+			continue;
+		}
+
+		while (ap_mailboxes[i].ready == 0) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
 	}
 }
 
+/*---------------------------------------------------------------------------
+ * Shift of the package ID in local APIC IDs. Taken from CPUID 0xB if it is
+ * there, otherwise from the number of logical processors in CPUID 1
+ *---------------------------------------------------------------------------*/
+static uint32_t get_package_id_shift(void)
+{
+	uint32_t info[4];
+	uint32_t level;
+	uint32_t logical;
+	uint32_t shift = 0;
+
+	startap_cpuid(0, info);
+	if (info[0] >= 0xB) {
+		/* shift of the last valid level gives the package ID */
+		for (level = 0; level < 8; level++) {
+			startap_cpuidex(0xB, level, info);
+			if (((info[2] >> 8) & 0xFF) == 0) {
+				break;
+			}
+			shift = info[0] & 0x1F;
+		}
+		if (level != 0) {
+			return shift;
+		}
+	}
+
+	startap_cpuid(1, info);
+	logical = (info[1] >> 16) & 0xFF;
+	while ((1U << shift) < logical) {
+		shift++;
+	}
+	return shift;
+}
+
+/* CPUID 0x80000007 EDX[8]: TSC runs at a constant rate in all C/P-states */
+static uint32_t tsc_is_invariant(void)
+{
+	uint32_t info[4];
+
+	startap_cpuid(0x80000000, info);
+	if (info[0] < 0x80000007) {
+		return 0;
+	}
+
+	startap_cpuid(0x80000007, info);
+	return (info[3] >> 8) & 1;
+}
+
+/* TSC ticks since base, saturated to 32 bits. 0 if tsc is not recorded */
+static uint32_t tsc_since(uint64_t tsc, uint64_t base)
+{
+	if ((tsc == 0) || (tsc < base)) {
+		return 0;
+	}
+	if ((tsc - base) > 0xFFFFFFFF) {
+		return 0xFFFFFFFF;
+	}
+	return (uint32_t)(tsc - base);
+}
+
+/* Sort values and get min, median and max of them */
+static void get_min_median_max(uint32_t *values, uint32_t count,
+			       uint32_t *min, uint32_t *median, uint32_t *max)
+{
+	uint32_t i;
+	uint32_t j;
+
+	if (count == 0) {
+		*min = *median = *max = 0;
+		return;
+	}
+
+	for (i = 1; i < count; i++) {
+		uint32_t value = values[i];
+
+		for (j = i; (j > 0) && (values[j - 1] > value); j--) {
+			values[j] = values[j - 1];
+		}
+		values[j] = value;
+	}
+
+	*min = values[0];
+	*median = values[count / 2];
+	*max = values[count - 1];
+}
+
+/*---------------------------------------------------------------------------
+ * Copy the bring-up stamps of arrived APs to boot info and summarize them
+ * per package. Should be called after the APs are launched.
+ *---------------------------------------------------------------------------*/
+void ap_procs_export_timing(boot_info_t *boot_info)
+{
+	static uint32_t arrival[BOOT_INFO_MAX_APS];
+	static uint32_t launch[BOOT_INFO_MAX_APS];
+	uint32_t count = count_arrived_aps();
+	uint32_t shift;
+	uint32_t packages = 0;
+	uint32_t i;
+	uint32_t p;
+
+	if ((NULL == boot_info) || (g_sipi_rounds == 0)) {
+		return;
+	}
+
+	if (count > BOOT_INFO_MAX_APS) {
+		count = BOOT_INFO_MAX_APS;
+	}
+
+	shift = get_package_id_shift();
+	boot_info->ap_tsc_base = g_sipi_tsc[0];
+
+	for (i = 0; i < count; i++) {
+		const ap_mailbox_t *mailbox = &ap_mailboxes[i];
+		boot_ap_timing_t *timing = &boot_info->ap_timing[i];
+		const uint64_t *sipi_rounds = g_sipi_tsc;
+		uint32_t num_of_rounds = g_sipi_rounds;
+		uint64_t sipi_tsc;
+		uint32_t r;
+
+		/* siblings of other packages got SIPI from their leader */
+		for (p = 1; p < g_ap_num_packages; p++) {
+			const ap_package_t *package = &g_ap_packages[p];
+
+			if (((mailbox->apic_id >> g_ap_package_shift) ==
+			     package->package_id) &&
+			    (mailbox->apic_id != package->leader_apic_id) &&
+			    (package->sipi_rounds != 0)) {
+				sipi_rounds = package->sipi_tsc;
+				num_of_rounds = package->sipi_rounds;
+				break;
+			}
+		}
+
+		/* AP answered the last SIPI sent before it arrived */
+		sipi_tsc = sipi_rounds[0];
+		for (r = 1; r < num_of_rounds; r++) {
+			if (sipi_rounds[r] <= mailbox->arrival_tsc) {
+				sipi_tsc = sipi_rounds[r];
+			}
+		}
+
+		timing->apic_id = mailbox->apic_id;
+		timing->package_id = mailbox->apic_id >> shift;
+		timing->sipi = tsc_since(sipi_tsc, boot_info->ap_tsc_base);
+		timing->arrival = tsc_since(mailbox->arrival_tsc,
+			boot_info->ap_tsc_base);
+		timing->stage2 = tsc_since(mailbox->stage2_tsc,
+			boot_info->ap_tsc_base);
+		timing->launch = tsc_since(mailbox->launch_tsc,
+			boot_info->ap_tsc_base);
+
+		for (p = 0; p < packages; p++) {
+			if (boot_info->package_timing[p].package_id ==
+			    timing->package_id) {
+				break;
+			}
+		}
+		if ((p == packages) && (packages < BOOT_INFO_MAX_PACKAGES)) {
+			mon_memset(&boot_info->package_timing[p], 0,
+				sizeof(boot_package_timing_t));
+			boot_info->package_timing[p].package_id = timing->package_id;
+			packages++;
+		}
+	}
+	boot_info->ap_timing_count = count;
+
+	for (i = 0; i < count; i++) {
+		boot_info->ap_tsc_offset[i] = ap_mailboxes[i].tsc_offset;
+	}
+
+	/* the verdict covers every AP xmon may run on, deferred ones and
+	 * those past the exported ones included */
+	boot_info->tsc_sync_count = 0;
+	boot_info->tsc_sync_error = 0;
+	boot_info->tsc_reliable = tsc_is_invariant();
+	for (i = 0; i < count_arrived_aps(); i++) {
+		const ap_mailbox_t *mailbox = &ap_mailboxes[i];
+
+		if (mailbox->ordered_id == 0) {
+			continue;
+		}
+
+		if (mailbox->tsc_rtt == 0) {
+			boot_info->tsc_reliable = 0;
+			continue;
+		}
+
+		boot_info->tsc_sync_count++;
+		if (mailbox->tsc_skewed) {
+			boot_info->tsc_reliable = 0;
+		}
+		if ((mailbox->tsc_rtt / 2) > boot_info->tsc_sync_error) {
+			boot_info->tsc_sync_error = mailbox->tsc_rtt / 2;
+		}
+	}
+	if (boot_info->tsc_sync_count == 0) {
+		boot_info->tsc_reliable = 0;
+	}
+
+	for (p = 0; p < packages; p++) {
+		boot_package_timing_t *summary = &boot_info->package_timing[p];
+		uint32_t arrivals = 0;
+		uint32_t launches = 0;
+
+		for (i = 0; i < count; i++) {
+			const boot_ap_timing_t *timing = &boot_info->ap_timing[i];
+
+			if (timing->package_id != summary->package_id) {
+				continue;
+			}
+
+			summary->ap_count++;
+			if ((timing->arrival != 0) &&
+			    (timing->arrival >= timing->sipi)) {
+				arrival[arrivals++] = timing->arrival - timing->sipi;
+			}
+			if ((timing->launch != 0) &&
+			    (timing->launch >= timing->sipi)) {
+				launch[launches++] = timing->launch - timing->sipi;
+			}
+		}
+
+		get_min_median_max(arrival, arrivals, &summary->arrival_min,
+			&summary->arrival_median, &summary->arrival_max);
+		get_min_median_max(launch, launches, &summary->launch_min,
+			&summary->launch_median, &summary->launch_max);
+	}
+	boot_info->package_timing_count = packages;
+}
+
+/*---------------------------------------------------------------------------
+ * APs increment the counter when they leave startap for the user function
+ * or the 64-bit entry. NULL - no counter, the launch is synchronous then.
+ *---------------------------------------------------------------------------*/
+void ap_procs_set_launch_counter(volatile uint32_t *counter)
+{
+	gp_ap_launch_counter = counter;
+}
+
+/*---------------------------------------------------------------------------
+ * Deferred APs wait for *release to reach their park index. NULL - no lazy
+ * launch, all APs go at once.
+ *---------------------------------------------------------------------------*/
+void ap_procs_set_release_word(volatile uint32_t *release)
+{
+	gp_ap_release = release;
+}
+
+uint32_t ap_procs_num_of_deferred_aps(void)
+{
+	return g_num_of_deferred_aps;
+}
+
+/*---------------------------------------------------------------------------
+ * A pre-os launch call after the first boot completed is S3 resume
+ *---------------------------------------------------------------------------*/
+boolean_t ap_procs_is_s3_resume(const mon_startup_struct_t *p_startup)
+{
+	boolean_t post_os_launch = (NULL != p_startup) &&
+				   BITMAP_GET(p_startup->flags,
+		MON_STARTUP_POST_OS_LAUNCH_MODE) != 0;
+
+	return !post_os_launch && g_boot_aps_saved;
+}
+
+/*---------------------------------------------------------------------------
+ * Use init64 for APs started with INIT32_FLAG_AP_LONG_MODE. It must stay
+ * valid until the APs are released, startap passes its own copy.
+ *---------------------------------------------------------------------------*/
+void ap_procs_enable_long_mode(const init64_struct_t *p_init64)
+{
+	gp_ap_init64 = p_init64;
+}
+
+/*---------------------------------------------------------------------------
+ * Release APs waiting in long mode to the 64-bit entry, which gets the AP
+ * ordered ID and arg1..arg3 in the registers as x32_init64_start() passes
+ * them.
+ * Return:
+ * FALSE if APs were started in protected mode, use ap_procs_run() then
+ *---------------------------------------------------------------------------*/
+boolean_t ap_procs_run_long_mode(uint64_t entry, void *arg1, void *arg2,
+				 void *arg3)
+{
+	if (!g_ap_long_mode) {
+		return FALSE;
+	}
+
+	g_ap_long_mode_entry = entry;
+	g_ap_long_mode_args[0] = (uint32_t)arg1;
+	g_ap_long_mode_args[1] = (uint32_t)arg2;
+	g_ap_long_mode_args[2] = (uint32_t)arg3;
+
+	ap_procs_run(NULL, NULL);
+	return TRUE;
+}
+
+/*---------------------------------------------------------------------*
+* Function  : assign_ap_stacks
+* Purpose   : Split the AP stack pool evenly between 'ap_count' APs, each
+*           : stack is AP_STACK_SIZE_MIN..AP_STACK_SIZE_MAX bytes. If the
+*           : pool is too small, only part of the APs get a stack.
+* Return    : Number of APs which got a stack
+* Notes     : Without a pool the stacks in i32_esp are used as is, as on
+*           : S3 resume.
+*---------------------------------------------------------------------*/
+static uint32_t assign_ap_stacks(uint32_t ap_count)
+{
+	uint32_t pool_base = gp_init32_data->i32_ap_stack_base;
+	uint32_t pool_size = gp_init32_data->i32_ap_stack_size;
+	uint32_t stack_size;
+	uint32_t i;
+
+	if (g_s3_resume || (pool_size == 0) || (ap_count == 0)) {
+		return ap_count;
+	}
+
+	stack_size = pool_size / ap_count;
+	if (stack_size > AP_STACK_SIZE_MAX) {
+		stack_size = AP_STACK_SIZE_MAX;
+	}
+
+	if (stack_size < AP_STACK_SIZE_MIN) {
+		stack_size = AP_STACK_SIZE_MIN;
+		ap_count = pool_size / AP_STACK_SIZE_MIN;
+	}
+
+	/* keep stack tops 16-byte aligned */
+	stack_size &= ~0xF;
+
+	for (i = 0; i < ap_count; ++i) {
+		gp_init32_data->i32_esp[i] = pool_base + (i + 1) * stack_size;
+	}
+
+	return ap_count;
+}
+
 /*---------------------------------------------------------------------*
 * Function  : bsp_enumerate_aps
-* Purpose   : Walk through ap_presence_array and counts discovered APs.
-*           : In addition modifies array thus it will contain AP IDs,
-*           : and not just 1/0.
+* Purpose   : Walk through arrival slots and assign AP ordered IDs [1..Max]
+*           : in order of local APIC IDs. APs which do not fit into
+*           : i32_num_of_aps or get no stack from the AP stack pool get
+*           : ID 0 and stay parked.
 * Return    : Total number of APs, discovered till now.
 * Notes     : Should be called on BSP
 *---------------------------------------------------------------------*/
-uint8_t bsp_enumerate_aps(void)
+uint32_t bsp_enumerate_aps(void)
 {
-	int i;
-	uint8_t ap_num = 0;
+	uint32_t arrived = count_arrived_aps();
+	uint32_t max_aps = gp_init32_data->i32_num_of_aps;
+	uint32_t ap_num = 0;
+	uint32_t i;
+	uint32_t j;
+
+	/* APs publish their IDs right after taking a slot */
+	for (i = 0; i < arrived; ++i) {
+		while (ap_mailboxes[i].apic_id == AP_APIC_ID_INVALID) {
+			__asm__ __volatile__ (
+				"pause"
+				);
+		}
+	}
+
+	max_aps = assign_ap_stacks((arrived < max_aps) ? arrived : max_aps);
 
-	for (i = 1; i < NELEMENTS(ap_presence_array); ++i) {
-		if (0 != ap_presence_array[i]) {
-			ap_presence_array[i] = ++ap_num;
+	for (i = 0; i < arrived; ++i) {
+		uint32_t ordered_id = 1;
+
+		for (j = 0; j < arrived; ++j) {
+			if (ap_mailboxes[j].apic_id < ap_mailboxes[i].apic_id) {
+				ordered_id++;
+			}
+		}
+
+		if (ordered_id <= max_aps) {
+			ap_mailboxes[i].ordered_id = ordered_id;
+			ap_num++;
 		}
 	}
 	return ap_num;
 }
 
+/* SMT ID width in local APIC IDs, 0 if CPUID does not tell */
+static uint32_t get_smt_id_shift(void)
+{
+	uint32_t info[4];
+
+	startap_cpuid(0, info);
+	if (info[0] < 0xB) {
+		return 0;
+	}
+
+	startap_cpuidex(0xB, 0, info);
+	if (((info[2] >> 8) & 0xFF) != 1) {     /* level 0 is not SMT */
+		return 0;
+	}
+	return info[0] & 0x1F;
+}
+
+/* Launch order of the lazy policy: first threads of cores, then siblings */
+static uint64_t lazy_ap_key(uint32_t apic_id, uint32_t smt_mask)
+{
+	return ((uint64_t)((apic_id & smt_mask) != 0) << 32) | apic_id;
+}
+
+/*---------------------------------------------------------------------*
+* Function  : defer_lazy_aps
+* Purpose   : Apply the lazy launch policy to enumerated APs. With
+*           : INIT32_FLAG_LAZY_SMT only the first thread of each core is
+*           : launched, with INIT32_FLAG_LAZY_APS no more than
+*           : i32_num_of_early_aps APs. Ordered IDs are given again, so
+*           : launched APs take [1..N] and deferred ones follow them in
+*           : the order of release.
+* Return    : Number of deferred APs
+*---------------------------------------------------------------------*/
+static uint32_t defer_lazy_aps(const init32_struct_t *p_init32_data)
+{
+	uint32_t arrived = count_arrived_aps();
+	uint32_t early = g_aps_counter;
+	uint32_t smt_mask = 0;
+	uint32_t first_threads = 0;
+	uint32_t i;
+	uint32_t j;
+
+	if (p_init32_data->i32_flags & INIT32_FLAG_LAZY_SMT) {
+		smt_mask = (1U << get_smt_id_shift()) - 1;
+	}
+
+	for (i = 0; i < arrived; ++i) {
+		uint32_t ordered_id = 1;
+
+		if (ap_mailboxes[i].ordered_id == 0) {
+			continue;
+		}
+
+		for (j = 0; j < arrived; ++j) {
+			if ((ap_mailboxes[j].ordered_id != 0) &&
+			    (lazy_ap_key(ap_mailboxes[j].apic_id, smt_mask) <
+			     lazy_ap_key(ap_mailboxes[i].apic_id, smt_mask))) {
+				ordered_id++;
+			}
+		}
+		ap_mailboxes[i].ordered_id = ordered_id;
+
+		if ((ap_mailboxes[i].apic_id & smt_mask) == 0) {
+			first_threads++;
+		}
+	}
+
+	if (early > first_threads) {
+		early = first_threads;
+	}
+	if ((p_init32_data->i32_flags & INIT32_FLAG_LAZY_APS) &&
+	    (early > p_init32_data->i32_num_of_early_aps)) {
+		early = p_init32_data->i32_num_of_early_aps;
+	}
+
+	for (i = 0; i < arrived; ++i) {
+		if (ap_mailboxes[i].ordered_id > early) {
+			ap_mailboxes[i].deferred = ap_mailboxes[i].ordered_id - early;
+		}
+	}
+
+	return g_aps_counter - early;
+}
+
 void ap_intialize_environment(void)
 {
-	mp_bootstrap_state = MP_BOOTSTRAP_STATE_INIT;
-	g_ready_counter = 0;
+	uint32_t i;
+
+	/* wakeup_init64.S depends on the mailbox layout */
+	COMPILE_TIME_ASSERT(sizeof(ap_mailbox_t) == CACHE_LINE_SIZE);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, apic_id) ==
+		AP_MAILBOX_APIC_ID_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, ordered_id) ==
+		AP_MAILBOX_ORDERED_ID_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, ready) ==
+		AP_MAILBOX_READY_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, deferred) ==
+		AP_MAILBOX_DEFERRED_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, arrival_tsc) ==
+		AP_MAILBOX_ARRIVAL_TSC_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, stage2_tsc) ==
+		AP_MAILBOX_STAGE2_TSC_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_mailbox_t, launch_tsc) ==
+		AP_MAILBOX_LAUNCH_TSC_OFFSET);
+	COMPILE_TIME_ASSERT(sizeof(ap_package_t) == CACHE_LINE_SIZE);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_package_t, package_id) ==
+		AP_PACKAGE_ID_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_package_t, arrived) ==
+		AP_PACKAGE_ARRIVED_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_package_t, leader_apic_id) ==
+		AP_PACKAGE_LEADER_APIC_ID_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(ap_package_t, leader_stack) ==
+		AP_PACKAGE_LEADER_STACK_OFFSET);
+	COMPILE_TIME_ASSERT(sizeof(mp_bootstrap_line_t) == CACHE_LINE_SIZE);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t, job_op) ==
+		MP_LINE_JOB_OP_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t, job_dst) ==
+		MP_LINE_JOB_DST_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t, job_src) ==
+		MP_LINE_JOB_SRC_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t, job_size) ==
+		MP_LINE_JOB_SIZE_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t,
+			job_chunk_size) == MP_LINE_JOB_CHUNK_SIZE_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t, job_chunks) ==
+		MP_LINE_JOB_CHUNKS_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t,
+			job_claim) == MP_LINE_JOB_CLAIM_OFFSET);
+	COMPILE_TIME_ASSERT(__builtin_offsetof(mp_bootstrap_line_t,
+			job_done_chunks) == MP_LINE_JOB_DONE_CHUNKS_OFFSET);
+
+	mp_bootstrap_state.state = MP_BOOTSTRAP_STATE_INIT;
+	mp_bootstrap_state.job_chunks = 0;
+	g_sipi_rounds = 0;
+	/* forget APs reported by the previous run (e.g. before S3) */
+	g_ap_arrival_counter = 0;
+	mon_memset(ap_mailboxes, 0, sizeof(ap_mailboxes));
+	for (i = 0; i < NELEMENTS(ap_mailboxes); ++i) {
+		ap_mailboxes[i].apic_id = AP_APIC_ID_INVALID;
+	}
 	g_user_func = 0;
 	g_any_data_for_user_func = 0;
 }
@@ -654,7 +2494,7 @@ void mp_set_bootstrap_state(mp_bootstrap_state_t new_state)
 	__asm__ __volatile__ (
 		"movl %0, %%eax\n\t"
 		"lock; xchgl %%eax, %1"
-		: : "m" (new_state), "m" (mp_bootstrap_state)
+		: : "m" (new_state), "m" (mp_bootstrap_state.state)
 		: "eax"
 		);
 }
@@ -22,6 +22,7 @@
 
 #include "mon_defs.h"
 #include "mon_startup.h"
+#include "boot_info.h"
 
 extern uint64_t __rdtsc(void);
 
@@ -79,4 +80,65 @@ uint32_t ap_procs_startup(init32_struct_t *p_init32_data,
  *---------------------------------------------------------------------------- */
 void ap_procs_run(func_continue_ap_t continue_ap_boot_func, void *any_data);
 
+/*----------------------------------------------------------------------------
+ * Copy per-AP bring-up stamps (SIPI, arrival, stage 2, 64-bit launch) to
+ * boot info and summarize them per package. Call it after APs are launched.
+ *---------------------------------------------------------------------------- */
+void ap_procs_export_timing(boot_info_t *boot_info);
+
+/*----------------------------------------------------------------------------
+ * Make APs count themselves when they leave startap. With the counter set
+ * and INIT32_FLAG_ASYNC_AP_LAUNCH ap_procs_run() does not wait for APs, the
+ * caller must wait for the counter before it gives loader memory away.
+ *---------------------------------------------------------------------------- */
+void ap_procs_set_launch_counter(volatile uint32_t *counter);
+
+/*----------------------------------------------------------------------------
+ * Lazy AP launch: APs deferred by INIT32_FLAG_LAZY_APS/INIT32_FLAG_LAZY_SMT
+ * wait until the release word reaches their park index [1..]. Without the
+ * release word all APs are launched at once. The release word, AP stacks
+ * and init64 tables must be in memory hidden from the guest.
+ *---------------------------------------------------------------------------- */
+void ap_procs_set_release_word(volatile uint32_t *release);
+
+/*----------------------------------------------------------------------------
+ * Number of APs, counted by ap_procs_startup(), which were deferred
+ *---------------------------------------------------------------------------- */
+uint32_t ap_procs_num_of_deferred_aps(void);
+
+/*----------------------------------------------------------------------------
+ * TRUE if this pre-os launch call is S3 resume: the first boot already
+ * completed and init32 is filled by xmon, its flags are stale.
+ *---------------------------------------------------------------------------- */
+boolean_t ap_procs_is_s3_resume(const mon_startup_struct_t *p_startup);
+
+/*----------------------------------------------------------------------------
+ * Let APs go from real mode straight to long mode with the page tables and
+ * GDT of p_init64 when ap_procs_startup() gets INIT32_FLAG_AP_LONG_MODE.
+ * Then ap_procs_run_long_mode() releases them to the 64-bit entry, it
+ * returns FALSE if APs were started in protected mode anyway.
+ *---------------------------------------------------------------------------- */
+void ap_procs_enable_long_mode(const init64_struct_t *p_init64);
+
+boolean_t ap_procs_run_long_mode(uint64_t entry, void *arg1, void *arg2,
+				 void *arg3);
+
+/*----------------------------------------------------------------------------
+ * Run large memcpy/memset on BSP and APs waiting for continuation signal,
+ * mon_bulk_mem_op_t handler (see common.h). Returns 0 if there are no APs
+ * to help.
+ *---------------------------------------------------------------------------- */
+int ap_procs_bulk_mem_op(void *dest, const void *src, char val,
+			 unsigned int count);
+
+/*----------------------------------------------------------------------------
+ * Calibrate TSC frequency, then get the result and how it was obtained
+ * (boot_tsc_source_t).
+ *---------------------------------------------------------------------------- */
+void startap_calibrate_tsc_ticks_per_msec(void);
+
+uint32_t startap_get_tsc_ticks_per_msec(void);
+
+uint32_t startap_get_tsc_source(void);
+
 #endif                          /* _AP_PROCS_INIT_H_ */
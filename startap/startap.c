@@ -15,9 +15,11 @@
 *******************************************************************************/
 
 #include "mon_defs.h"
+#include "common.h"
 #include "x32_init64.h"
 #include "ap_procs_init.h"
 #include "mon_startup.h"
+#include "boot_info.h"
 
 typedef
 	void (CDECL * xmon_image_entry_point_t)(uint32_t local_apic_id,
@@ -33,6 +35,8 @@ typedef struct {
 
 static application_params_struct_t application_params;
 static init64_struct_t *gp_init64;
+/* init64 of the loader is gone once Linux runs, deferred APs use this copy */
+static init64_struct_t g_init64;
 
 /*------------------Forward Declarations for Local Functions------------------*/
 static void CDECL start_application(uint32_t cpu_id,
@@ -41,38 +45,106 @@ void CDECL startap_main(init32_struct_t *p_init32, init64_struct_t *p_init64,
 			mon_startup_struct_t *p_startup, uint32_t entry_point)
 {
 	uint32_t application_procesors;
+	uint32_t deferred_procesors = 0;
+	boot_info_t *boot_info = NULL;
+
+	if (NULL != p_init64) {
+		boot_info = boot_info_validate(p_init64->i64_boot_info);
+	}
+	boot_info_record(boot_info, BOOT_EVENT_STARTAP_ENTRY);
+
+	/* calibrate once here, AP startup delays and xmon rely on the result.
+	 * startap stays resident, so S3 resume reuses the first boot result */
+	if (startap_get_tsc_ticks_per_msec() == 0) {
+		startap_calibrate_tsc_ticks_per_msec();
+	}
+	if (NULL != boot_info) {
+		boot_info->tsc_ticks_per_msec = startap_get_tsc_ticks_per_msec();
+		boot_info->tsc_source = startap_get_tsc_source();
+	}
+
+	/* on S3 resume init32 comes from xmon, and a kick-only flag left from
+	 * the first boot must not stop the launch */
+	if ((NULL != p_init32) && ap_procs_is_s3_resume(p_startup)) {
+		p_init32->i32_flags = 0;
+	}
+
+	/* early call by the loader, APs are released by the next call */
+	if ((NULL != p_init32) &&
+	    (p_init32->i32_flags & INIT32_FLAG_KICK_APS_ONLY)) {
+		ap_procs_startup(p_init32, NULL);
+		p_init32->i32_bulk_mem_op = (uint32_t)ap_procs_bulk_mem_op;
+		boot_info_record(boot_info, BOOT_EVENT_APS_KICKED);
+		return;
+	}
+
+	if (NULL != p_init64) {
+		mon_memcpy(&g_init64, p_init64, sizeof(g_init64));
+		p_init64 = &g_init64;
+	}
 
 	if (NULL != p_init32) {
+		if (NULL != p_init64) {
+			ap_procs_enable_long_mode(p_init64);
+		}
+		if (NULL != boot_info) {
+			boot_info->aps_released = 0;
+			boot_info->aps_launched = 0;
+			boot_info->aps_deferred = 0;
+			/* ap_release is zeroed at the first boot only, APs
+			 * released by xmon stay released over S3 */
+			ap_procs_set_launch_counter(&boot_info->aps_launched);
+			ap_procs_set_release_word(&boot_info->ap_release);
+		} else {
+			ap_procs_set_launch_counter(NULL);
+			ap_procs_set_release_word(NULL);
+		}
 		/* wakeup APs */
 		application_procesors = ap_procs_startup(p_init32, p_startup);
+		deferred_procesors = ap_procs_num_of_deferred_aps();
 	} else {
 		application_procesors = 0;
 	}
 #ifdef UNIPROC
 	application_procesors = 0;
+	deferred_procesors = 0;
 #endif
+	boot_info_record(boot_info, BOOT_EVENT_APS_STARTED);
 
 	gp_init64 = p_init64;
 
 	if (BITMAP_GET(p_startup->flags, MON_STARTUP_POST_OS_LAUNCH_MODE) == 0) {
 		/* update the number of processors in mon_startup_struct_t for pre os
-		 * launch */
+		 * launch. Deferred APs are added by xmon when it releases them */
 		p_startup->number_of_processors_at_boot_time =
-			application_procesors + 1;
+			application_procesors - deferred_procesors + 1;
 	}
 
 	application_params.ep = entry_point;
 	application_params.any_data1 = (void *)p_startup;
 	application_params.any_data2 = NULL;
-	application_params.any_data3 = NULL;
+	/* the last xmon entry argument is reserved, use it for boot info */
+	application_params.any_data3 = (void *)boot_info;
+
+	if (NULL != boot_info) {
+		boot_info->aps_released =
+			application_procesors - deferred_procesors;
+		boot_info->aps_deferred = deferred_procesors;
+	}
 
-	/* first launch application on AP cores */
-	if (application_procesors > 0) {
+	/* first launch application on AP cores. With asynchronous launch BSP
+	 * goes on as soon as APs are released */
+	if ((application_procesors > 0) &&
+	    !ap_procs_run_long_mode(application_params.ep,
+		    application_params.any_data1, application_params.any_data2,
+		    application_params.any_data3)) {
 		ap_procs_run((func_continue_ap_t)start_application,
 			&application_params);
 	}
+	ap_procs_export_timing(boot_info);
 
 	/* and then launch application on BSP */
+	boot_info_record(boot_info, BOOT_EVENT_XMON_LAUNCH);
 	start_application(0, &application_params);
 }
 
@@ -27,11 +27,29 @@
 #include "ia32_defs.h"
 #include "common_types.h"
 
+/* startap carves per-AP stacks of this size range from the AP stack pool */
+#define AP_STACK_SIZE_MIN 0x400
+#define AP_STACK_SIZE_MAX 0x2000
+
+/* i32_flags */
+#define INIT32_FLAG_KICK_APS_ONLY       0x1     /* send INIT-SIPI and return */
+#define INIT32_FLAG_APS_ALREADY_STARTED 0x2     /* APs were kicked before */
+#define INIT32_FLAG_AP_LONG_MODE        0x4     /* APs go to long mode directly */
+#define INIT32_FLAG_ASYNC_AP_LAUNCH     0x8     /* BSP does not wait for APs */
+#define INIT32_FLAG_LAZY_APS            0x10    /* launch i32_num_of_early_aps */
+#define INIT32_FLAG_LAZY_SMT            0x20    /* launch one thread per core */
+
 typedef struct _INIT32_STRUCT {
 	uint32_t i32_low_memory_page;           /* address of page in low memory, used for AP bootstrap */
 	uint16_t i32_num_of_aps;                /* number of detected APs (Application Processors) */
-	uint16_t i32_pad;
+	uint16_t i32_flags;                     /* INIT32_FLAG_xxx */
 	uint32_t i32_esp[MAX_CPUS];             /* array of 32-bit SPs (SP - top of the stack) */
+	uint32_t i32_num_of_known_aps;          /* exact number of APs if known in advance, 0 otherwise */
+	uint32_t i32_ap_apic_ids[MAX_CPUS];     /* local APIC IDs of known APs (e.g. from ACPI MADT) */
+	uint32_t i32_ap_stack_base;             /* AP stack pool, i32_esp is filled from it after */
+	uint32_t i32_ap_stack_size;             /* AP enumeration. Size 0: i32_esp is preset */
+	uint32_t i32_bulk_mem_op;               /* out: mon_bulk_mem_op_t run by kicked APs */
+	uint32_t i32_num_of_early_aps;          /* INIT32_FLAG_LAZY_APS: APs launched at once, the rest wait */
 } init32_struct_t;
 
 typedef struct _INIT64_STRUCT {
@@ -39,6 +57,7 @@ typedef struct _INIT64_STRUCT {
 	ia32_gdtr_t i64_gdtr;           /* still in 32-bit format */
 	uint64_t i64_efer;              /* EFER minimal required value */
 	uint32_t i64_cr3;               /* 32-bit value of CR3 */
+	uint32_t i64_boot_info;         /* address of boot_info_t, 0 if absent */
 } init64_struct_t;
 
 void x32_init64_setup(void);